@@ -370,14 +370,30 @@ size_t get_timeout(const char* str) {
     }
 }
 
+// "pbkdf2" or "scrypt" optionally followed by ":COST"
+bool get_kdf(const char* str, http_session_kdf_t* kdf, unsigned* cost) {
+    size_t len = strcspn(str, ":");
+    if(len == sizeof("pbkdf2") - 1 && strncmp(str, "pbkdf2", len) == 0) *kdf = HTTP_SESSION_KDF_PBKDF2;
+    else if(len == sizeof("scrypt") - 1 && strncmp(str, "scrypt", len) == 0) *kdf = HTTP_SESSION_KDF_SCRYPT;
+    else return false;
+    *cost = ((str[len] == ':') ? (unsigned)strtoul(str + len + 1, NULL, 10) : 0);
+    return true;
+}
+
 void app_start(int argc, char* argv[], http_server_t* server) {
     char* root_path = NULL;
     char* server_data = NULL;
     size_t session_timeout_s = 0;
+    http_session_kdf_t kdf = HTTP_SESSION_KDF_PBKDF2;
+    unsigned kdf_cost = 0;
+    size_t kdf_threads = 0;
     const char* const short_opts = "";
     const struct option long_opts[] = {
         {"root", required_argument, NULL, 'r'},
         {"timeout", required_argument, NULL, 't'},
+        {"stateless", no_argument, NULL, 's'},
+        {"kdf", required_argument, NULL, 'k'},
+        {"kdf-threads", required_argument, NULL, 'K'},
         {NULL, no_argument, NULL, 0}
     };
     bool parse = true;
@@ -391,6 +407,15 @@ void app_start(int argc, char* argv[], http_server_t* server) {
             session_timeout_s = get_timeout(optarg);
             break;
         }
+        case 's':
+            http_session_set_stateless(true);
+            break;
+        case 'k':
+            if(!get_kdf(optarg, &kdf, &kdf_cost)) printf("\nUnkown kdf: %s\n", optarg);
+            break;
+        case 'K':
+            kdf_threads = strtoul(optarg, NULL, 10);
+            break;
         case -1:
             parse = false;
             break;
@@ -420,6 +445,7 @@ void app_start(int argc, char* argv[], http_server_t* server) {
         gen_path(view_path, "resources/", resources_path);
     }
 
+    http_session_set_kdf(kdf, kdf_cost, kdf_threads);
     http_session_engine_start(10, server_data, session_timeout_s);
 
     http_register_method(server, "/", HTTP_GET, crypto_get_resource);
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 enum {
     ID_FIELD = 0,
@@ -30,6 +32,24 @@ int Coin_operationType(const char* str, size_t len) {
     return 0;
 }
 
+// Running sums kept next to each CSV in <file>.sum, they are only valid for the CSV size and modification time
+// they were taken at. The sums are added in the same order and precision as a full scan so both give the same result
+#define COIN_SUMMARY_MAGIC      0x4d555343u
+#define COIN_SUMMARY_VERSION    2
+
+typedef struct coin_summary_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t csvSize;
+    // An edit that keeps the size still moves the modification time
+    int64_t csvMtime_s;
+    int64_t csvMtime_ns;
+    float amount_coin;
+    float totalBuy_usd;
+    float totalBuy_coin;
+    float totalSell_usd;
+}coin_summary_t;
+
 char* strupper(char* dst, const char* src) {
     char* ret = dst;
     while(*src) *dst++ = toupper(*src++);
@@ -37,55 +57,104 @@ char* strupper(char* dst, const char* src) {
     return ret;
 }
 
-char* Coin_getInfo(const char* name, const char* csvFile) {
-    csv_raw_t csv;
-    CSV_load(&csv, csvFile);
+void Coin_summaryAdd(coin_summary_t* summary, const char* line) {
+    char tmp[16];
 
-    char ticker[32];
-    strupper(ticker, name);
+    CSV_getField(line, AMOUNT_FIELD, tmp, sizeof(tmp));
+    double amount = strtod(tmp, NULL);
 
-    float amount_coin = 0;
-    float totalBuy_usd = 0;
-    float totalBuy_coin = 0;
-    float totalSell_usd = 0;
-    const char* line = NULL;
-    for(int i = 0; (line = CSV_getLine(&csv, i)) != NULL; ++i){
-        char tmp[16];
+    CSV_getField(line, USD_FIELD, tmp, sizeof(tmp));
+    double price = strtod(tmp, NULL);
 
-        CSV_getField(line, AMOUNT_FIELD, tmp, sizeof(tmp));
-        double amount = strtod(tmp, NULL);
+    size_t size = CSV_getField(line, TYPE_FIELD, tmp, sizeof(tmp));
+    switch(Coin_operationType(tmp, size)) {
+    case COIN_BUY:
+        summary->amount_coin += amount;
+        summary->totalBuy_usd += price;
+        summary->totalBuy_coin += amount;
+        break;
+    case COIN_SELL:
+        summary->amount_coin -= amount;
+        summary->totalSell_usd += price;
+        break;
+    case COIN_YIELD:
+        summary->amount_coin += amount;
+        summary->totalBuy_usd += 0;
+        summary->totalBuy_coin += amount;
+        break;
+    default:
+        printf("ERROR: Bad transaction: %s\n", line);
+        break;
+    }
+}
 
-        CSV_getField(line, USD_FIELD, tmp, sizeof(tmp));
-        double price = strtod(tmp, NULL);
-
-        size_t size = CSV_getField(line, TYPE_FIELD, tmp, sizeof(tmp));
-        switch(Coin_operationType(tmp, size)) {
-        case COIN_BUY:
-            amount_coin += amount;
-            totalBuy_usd += price;
-            totalBuy_coin += amount;
-            break;
-        case COIN_SELL:
-            amount_coin -= amount;
-            totalSell_usd += price;
-            break;
-        case COIN_YIELD:
-            amount_coin += amount;
-            totalBuy_usd += 0;
-            totalBuy_coin += amount;
-            break;
-        default:
-            printf("ERROR: Bad transaction: %s\n", line);
-            break;
-        }
+void Coin_summaryScan(coin_summary_t* summary, csv_raw_t* csv) {
+    memset(summary, 0, sizeof(*summary));
+    summary->magic = COIN_SUMMARY_MAGIC;
+    summary->version = COIN_SUMMARY_VERSION;
+    const char* line = NULL;
+    for(int i = 0; (line = CSV_getLine(csv, i)) != NULL; ++i) {
+        Coin_summaryAdd(summary, line);
     }
-    float avgPrice_usd = totalBuy_usd / totalBuy_coin;
+}
 
-    CSV_close(&csv);
+int Coin_summaryRead(coin_summary_t* summary, const char* csvFile) {
+    char file[256];
+    snprintf(file, sizeof(file), "%s.sum", csvFile);
+    FILE* fp = fopen(file, "r");
+    if(fp == NULL) return -1;
+    size_t len = fread(summary, sizeof(*summary), 1, fp);
+    fclose(fp);
+    if(len != 1 || summary->magic != COIN_SUMMARY_MAGIC || summary->version != COIN_SUMMARY_VERSION) return -1;
+    return 0;
+}
+
+bool Coin_summaryMatches(const coin_summary_t* summary, const struct stat* buf) {
+    return summary->csvSize == (uint64_t)buf->st_size && summary->csvMtime_s == (int64_t)buf->st_mtim.tv_sec &&
+        summary->csvMtime_ns == (int64_t)buf->st_mtim.tv_nsec;
+}
+
+void Coin_summaryStamp(coin_summary_t* summary, const struct stat* buf) {
+    summary->csvSize = (uint64_t)buf->st_size;
+    summary->csvMtime_s = (int64_t)buf->st_mtim.tv_sec;
+    summary->csvMtime_ns = (int64_t)buf->st_mtim.tv_nsec;
+}
+
+// Written aside and renamed, a torn summary is never read
+int Coin_summaryWrite(coin_summary_t* summary, const char* csvFile) {
+    char file[256], tmp[256];
+    snprintf(file, sizeof(file), "%s.sum", csvFile);
+    snprintf(tmp, sizeof(tmp), "%s.sum.tmp", csvFile);
+    FILE* fp = fopen(tmp, "w");
+    if(fp == NULL) return -1;
+    size_t len = fwrite(summary, sizeof(*summary), 1, fp);
+    if(fclose(fp) != 0 || len != 1) return -1;
+    return rename(tmp, file);
+}
+
+char* Coin_getInfo(const char* name, const char* csvFile) {
+    char ticker[32];
+    strupper(ticker, name);
+
+    // The CSV is only read when its sums are missing or were taken before its last change
+    coin_summary_t summary;
+    struct stat buf;
+    if(stat(csvFile, &buf) != 0) {
+        memset(&summary, 0, sizeof(summary));
+    }
+    else if(Coin_summaryRead(&summary, csvFile) != 0 || !Coin_summaryMatches(&summary, &buf)) {
+        csv_raw_t csv;
+        CSV_load(&csv, csvFile);
+        Coin_summaryScan(&summary, &csv);
+        Coin_summaryStamp(&summary, &buf);
+        CSV_close(&csv);
+        Coin_summaryWrite(&summary, csvFile);
+    }
+    float avgPrice_usd = summary.totalBuy_usd / summary.totalBuy_coin;
 
     const char format[] = "{\"symbol\":\"%s\",\"amount\":%f,\"avgPrice\":%f,\"totalBuy\":%f,\"totalSell\":%f}";
     char* coinJson = malloc(sizeof(format) + 10 + 10 * 4);
-    sprintf(coinJson, format, ticker, amount_coin, avgPrice_usd, totalBuy_usd, totalSell_usd);
+    sprintf(coinJson, format, ticker, summary.amount_coin, avgPrice_usd, summary.totalBuy_usd, summary.totalSell_usd);
     
     return coinJson;
 }
@@ -154,11 +223,24 @@ int Coin_addTransacation(const char* name, const char* csvFile, const char* tran
     for(i = 0; *str != '\"'; i++) date[i] = *str++;
     date[i] = 0;
 
+    // Sums taken at the current size and time only miss the new line, otherwise the loaded lines are scanned
+    coin_summary_t summary;
+    struct stat buf;
+    bool current = (fstat(fileno(csv.fd), &buf) == 0 && Coin_summaryRead(&summary, csvFile) == 0 &&
+        Coin_summaryMatches(&summary, &buf));
+
     char transaction[256];
     sprintf(transaction, "%s;%s;%s;%f;%f", date, type, ticker, amount, price);
     printf("TRANSACTION: %s\n\n", transaction);
     CSV_appendNewLine(&csv, transaction);
 
+    if(current) Coin_summaryAdd(&summary, CSV_getLine(&csv, csv.entries - 1));
+    else Coin_summaryScan(&summary, &csv);
+    if(fstat(fileno(csv.fd), &buf) == 0) {
+        Coin_summaryStamp(&summary, &buf);
+        Coin_summaryWrite(&summary, csvFile);
+    }
+
     int id = csv.lastId - 1;
 
     CSV_close(&csv);
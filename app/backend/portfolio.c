@@ -7,6 +7,48 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <lock.h>
+
+// Portfolios are kept in memory from their first use, polling the coins list then costs no disk access.
+// Every change goes through PortfolioAddCoinTransactions, it updates the coin it touched and drops the list.
+// At most PORTFOLIO_CACHED are kept, the least recently used one nobody holds is dropped for a new one
+#define PORTFOLIO_BUCKETS   256
+#define PORTFOLIO_COINS     8
+#define PORTFOLIO_CACHED    128
+
+typedef struct portfolio_coin_t {
+    char name[16];
+    char* info;
+    // Built the first time they are asked for
+    char* transactions;
+}portfolio_coin_t;
+
+typedef struct portfolio_t {
+    // Owned by the map lock: the bucket chain, the recently used list and the users holding the portfolio
+    struct portfolio_t* next;
+    struct portfolio_t* prev_used;
+    struct portfolio_t* next_used;
+    size_t bucket;
+    size_t users;
+    // Out of the map, freed by its last user
+    bool forgotten;
+    // Serializes the portfolio users, the files are only written with it held
+    lock_t lock;
+    bool loaded;
+    size_t count;
+    size_t size;
+    portfolio_coin_t* coins;
+    // Rebuilt from the coins after a change
+    char* list;
+    char path[];
+}portfolio_t;
+
+static lock_t portfolios_lock = LOCK_INITIALIZER;
+static portfolio_t* portfolios[PORTFOLIO_BUCKETS];
+// Most recently used first
+static portfolio_t* portfolios_used_head;
+static portfolio_t* portfolios_used_tail;
+static size_t portfolios_count;
 
 DIR* OpenDirectory(const char* dir_path) {
     DIR* dir = opendir(dir_path);
@@ -35,6 +77,9 @@ int PortfolioCreate(const char* path, const char* name) {
     }
     new_name[name_len + path_len] = 0;
 
+    // Whatever was cached for a portfolio by that name is not this one
+    PortfolioForget(new_name);
+
     DIR* dir = OpenDirectory(new_name);
     if(dir == NULL) return -1;
     CloseDirecotry(dir);
@@ -52,38 +97,200 @@ size_t PortfolioCountCoins(DIR* portfolioDir) {
     return count;
 }
 
-char* PortfolioGetCoinsList(const char* portfolio) {
-    char* coinsJson = malloc(4096*2);
+portfolio_coin_t* PortfolioFindCoin(portfolio_t* portfolio, const char* name) {
+    for(size_t i = 0; i < portfolio->count; ++i) {
+        if(strcmp(portfolio->coins[i].name, name) == 0) return &portfolio->coins[i];
+    }
+    return NULL;
+}
+
+portfolio_coin_t* PortfolioAddCoin(portfolio_t* portfolio, const char* name) {
+    if(portfolio->count == portfolio->size) {
+        portfolio->size = ((portfolio->size == 0) ? PORTFOLIO_COINS : portfolio->size * 2);
+        portfolio->coins = realloc(portfolio->coins, sizeof(portfolio_coin_t) * portfolio->size);
+    }
+    portfolio_coin_t* coin = &portfolio->coins[portfolio->count++];
+    memset(coin, 0, sizeof(*coin));
+    strncpy(coin->name, name, sizeof(coin->name) - 1);
+    return coin;
+}
+
+// Called with the portfolio lock held, reads every coin once
+int PortfolioLoad(portfolio_t* portfolio) {
     struct dirent* entry;
     struct stat buf;
     char file[256] = {0};
-    DIR* dir = OpenDirectory(portfolio);
-    if(dir == NULL) return NULL;
+    DIR* dir = OpenDirectory(portfolio->path);
+    if(dir == NULL) return -1;
 
-    strcpy(file, portfolio);
+    strcpy(file, portfolio->path);
     size_t len = strlen(file);
     file[len++] = '/';
 
-    coinsJson[0] = '[';
-    size_t size = 1;
     while ((entry = readdir(dir)) != NULL) {
         sprintf(&file[len], "%s", entry->d_name);
         stat(file, &buf);
 
-        if(S_ISREG(buf.st_mode)) {
+        // Coins are their CSV, the other files hold what is derived from it
+        const char* ext = strrchr(entry->d_name, '.');
+        if(S_ISREG(buf.st_mode) && ext != NULL && strcmp(ext, ".csv") == 0) {
             char name[16];
             int i;
             for(i = 0; entry->d_name[i] != '.'; ++i) name[i] = entry->d_name[i];
             name[i] = '\0';
-            
-            char* coin = Coin_getInfo(name, file);
-            size += sprintf(&coinsJson[size], "%s,", coin);
-            free(coin);
+
+            PortfolioAddCoin(portfolio, name)->info = Coin_getInfo(name, file);
         }
     }
-    coinsJson[size - 1] = ']';
 
     CloseDirecotry(dir);
+    portfolio->loaded = true;
+    return 0;
+}
+
+size_t PortfolioBucket(const char* path) {
+    // FNV-1a
+    size_t hash = 0xcbf29ce484222325ull;
+    for(const char* c = path; *c; ++c) hash = (hash ^ (unsigned char)*c) * 0x100000001b3ull;
+    return hash % PORTFOLIO_BUCKETS;
+}
+
+// Called with the map lock held
+portfolio_t* PortfolioFind(const char* path, size_t bucket) {
+    portfolio_t* portfolio = portfolios[bucket];
+    while(portfolio != NULL && strcmp(portfolio->path, path) != 0) portfolio = portfolio->next;
+    return portfolio;
+}
+
+// Called with the map lock held
+void PortfolioUnlinkUsed(portfolio_t* portfolio) {
+    if(portfolio->prev_used != NULL) portfolio->prev_used->next_used = portfolio->next_used;
+    else portfolios_used_head = portfolio->next_used;
+    if(portfolio->next_used != NULL) portfolio->next_used->prev_used = portfolio->prev_used;
+    else portfolios_used_tail = portfolio->prev_used;
+}
+
+// Called with the map lock held
+void PortfolioLinkUsed(portfolio_t* portfolio) {
+    portfolio->prev_used = NULL;
+    portfolio->next_used = portfolios_used_head;
+    if(portfolios_used_head != NULL) portfolios_used_head->prev_used = portfolio;
+    else portfolios_used_tail = portfolio;
+    portfolios_used_head = portfolio;
+}
+
+// Called with the map lock held, takes the portfolio out of the map, the caller frees it once unused
+void PortfolioUnlink(portfolio_t* portfolio) {
+    portfolio_t** link = &portfolios[portfolio->bucket];
+    while(*link != portfolio) link = &(*link)->next;
+    *link = portfolio->next;
+    PortfolioUnlinkUsed(portfolio);
+    portfolios_count -= 1;
+    portfolio->forgotten = true;
+}
+
+void PortfolioFree(portfolio_t* portfolio) {
+    for(size_t i = 0; i < portfolio->count; ++i) {
+        free(portfolio->coins[i].info);
+        free(portfolio->coins[i].transactions);
+    }
+    free(portfolio->coins);
+    free(portfolio->list);
+    lock_destroy(&portfolio->lock);
+    free(portfolio);
+}
+
+// Unlocks a portfolio returned by PortfolioGet, the last user of a forgotten one frees it
+void PortfolioRelease(portfolio_t* portfolio) {
+    unlock(&portfolio->lock);
+    lock(&portfolios_lock);
+    portfolio->users -= 1;
+    bool unused = (portfolio->forgotten && portfolio->users == 0);
+    unlock(&portfolios_lock);
+    if(unused) PortfolioFree(portfolio);
+}
+
+// Returns the portfolio locked and loaded, NULL when its directory can not be opened.
+// Every portfolio returned is handed back with PortfolioRelease
+portfolio_t* PortfolioGet(const char* path) {
+    size_t bucket = PortfolioBucket(path);
+    portfolio_t* evicted = NULL;
+
+    lock(&portfolios_lock);
+    portfolio_t* portfolio = PortfolioFind(path, bucket);
+    if(portfolio != NULL) {
+        PortfolioUnlinkUsed(portfolio);
+    }
+    else {
+        portfolio = calloc(1, sizeof(portfolio_t) + strlen(path) + 1);
+        strcpy(portfolio->path, path);
+        lock_init(&portfolio->lock);
+        portfolio->bucket = bucket;
+        portfolio->next = portfolios[bucket];
+        portfolios[bucket] = portfolio;
+        portfolios_count += 1;
+    }
+    PortfolioLinkUsed(portfolio);
+    portfolio->users += 1;
+
+    // Over the bound, the least recently used portfolios nobody holds go, they are freed outside the map lock
+    for(portfolio_t* old = portfolios_used_tail; old != NULL && portfolios_count > PORTFOLIO_CACHED;) {
+        portfolio_t* prev = old->prev_used;
+        if(old->users == 0) {
+            PortfolioUnlink(old);
+            old->next = evicted;
+            evicted = old;
+        }
+        old = prev;
+    }
+    unlock(&portfolios_lock);
+
+    while(evicted != NULL) {
+        portfolio_t* next = evicted->next;
+        PortfolioFree(evicted);
+        evicted = next;
+    }
+
+    // Loaded by its first user, outside the map lock so other portfolios are not held by the disk
+    lock(&portfolio->lock);
+    if(!portfolio->loaded && PortfolioLoad(portfolio) != 0) {
+        PortfolioRelease(portfolio);
+        return NULL;
+    }
+    return portfolio;
+}
+
+void PortfolioForget(const char* path) {
+    size_t bucket = PortfolioBucket(path);
+    lock(&portfolios_lock);
+    portfolio_t* portfolio = PortfolioFind(path, bucket);
+    bool unused = false;
+    if(portfolio != NULL) {
+        PortfolioUnlink(portfolio);
+        unused = (portfolio->users == 0);
+    }
+    unlock(&portfolios_lock);
+    if(unused) PortfolioFree(portfolio);
+}
+
+char* PortfolioGetCoinsList(const char* portfolio) {
+    portfolio_t* cached = PortfolioGet(portfolio);
+    if(cached == NULL) return NULL;
+
+    if(cached->list == NULL) {
+        size_t size = sizeof("[]");
+        for(size_t i = 0; i < cached->count; ++i) size += strlen(cached->coins[i].info) + 1;
+        cached->list = malloc(size);
+        cached->list[0] = '[';
+        size = 1;
+        for(size_t i = 0; i < cached->count; ++i) {
+            size += sprintf(&cached->list[size], "%s,", cached->coins[i].info);
+        }
+        if(size > 1) size -= 1;
+        strcpy(&cached->list[size], "]");
+    }
+    char* coinsJson = strdup(cached->list);
+    PortfolioRelease(cached);
 
     return coinsJson;
 }
@@ -98,8 +305,19 @@ char* strlower(char* dst, const char* src) {
 char* PortfolioGetCoinTransactions(const char* portfolio, const char* coin) {
     char csv_file[256] = {0};
     char ticker[32] = {0};
-    sprintf(csv_file, "%s/%s.csv", portfolio, strlower(ticker, coin));
-    return Coin_getTransactions(coin, csv_file);
+    strlower(ticker, coin);
+    portfolio_t* cached = PortfolioGet(portfolio);
+    if(cached == NULL) return strdup("[]");
+
+    portfolio_coin_t* entry = PortfolioFindCoin(cached, ticker);
+    if(entry != NULL && entry->transactions == NULL) {
+        sprintf(csv_file, "%s/%s.csv", portfolio, ticker);
+        entry->transactions = Coin_getTransactions(coin, csv_file);
+    }
+    // Coins without transactions have no file
+    char* transactionsJson = strdup((entry != NULL) ? entry->transactions : "[]");
+    PortfolioRelease(cached);
+    return transactionsJson;
 }
 
 char* PortfolioAddCoinTransactions(const char* portfolio, const char* coin, const char* transactionJson) {
@@ -113,7 +331,19 @@ char* PortfolioAddCoinTransactions(const char* portfolio, const char* coin, cons
     ticker[i] = 0;
 
     sprintf(csv_file, "%s/%s.csv", portfolio, strlower(ticker, ticker));
+    portfolio_t* cached = PortfolioGet(portfolio);
     Coin_addTransacation(ticker, csv_file, transactionJson);
+    if(cached == NULL) return (char*)transactionJson;
+
+    portfolio_coin_t* entry = PortfolioFindCoin(cached, ticker);
+    if(entry == NULL) entry = PortfolioAddCoin(cached, ticker);
+    free(entry->info);
+    entry->info = Coin_getInfo(ticker, csv_file);
+    free(entry->transactions);
+    entry->transactions = NULL;
+    free(cached->list);
+    cached->list = NULL;
+    PortfolioRelease(cached);
 
     return (char*)transactionJson;
-}
\ No newline at end of file
+}
@@ -9,4 +9,7 @@ char* PortfolioGetCoinTransactions(const char* portfolio, const char* coin);
 
 char* PortfolioAddCoinTransactions(const char* portfolio, const char* coin, const char* transactionJson);
 
+// Drops the cached copy of a portfolio, called when its files are removed or replaced
+void PortfolioForget(const char* portfolio);
+
 #endif
\ No newline at end of file
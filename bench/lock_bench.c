@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <lock.h>
+#include <queue.h>
+
+#define BENCH_ITERATIONS    2000000
+#define BENCH_MAX_THREADS   16
+
+#ifdef LOCK_FUTEX
+#define BENCH_LOCKS         "futex"
+#else
+#define BENCH_LOCKS         "pthread"
+#endif
+
+typedef struct bench_t {
+    lock_t lock;
+    signal_t signal;
+    rwlock_t rwlock;
+    queue_t* queue;
+    size_t iterations;
+    size_t threads;
+    volatile uint64_t counter;
+} bench_t;
+
+static uint64_t bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+static void bench_report(const char* name, size_t threads, size_t operations, uint64_t elapsed_ns) {
+    printf("%-8s %-24s threads %2zu  %8.1f ns/op  %10.0f ops/s\n", BENCH_LOCKS, name, threads,
+        (double)elapsed_ns / operations, (double)operations * 1000000000 / elapsed_ns);
+}
+
+static void bench_run(bench_t* bench, const char* name, void* (*entry)(void*), size_t operations) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    uint64_t start = bench_now_ns();
+    for(size_t i = 0; i < bench->threads; ++i) pthread_create(&threads[i], NULL, entry, bench);
+    for(size_t i = 0; i < bench->threads; ++i) pthread_join(threads[i], NULL);
+    bench_report(name, bench->threads, operations, bench_now_ns() - start);
+}
+
+static void* bench_lock(void* arg) {
+    bench_t* bench = (bench_t*)arg;
+    for(size_t i = 0; i < bench->iterations; ++i) {
+        lock(&bench->lock);
+        bench->counter += 1;
+        unlock(&bench->lock);
+    }
+    return NULL;
+}
+
+static void* bench_signal(void* arg) {
+    bench_t* bench = (bench_t*)arg;
+    // Nobody ever waits, measures the cost of signaling an idle condition
+    for(size_t i = 0; i < bench->iterations; ++i) {
+        lock(&bench->lock);
+        bench->counter += 1;
+        unlock_signal(&bench->lock, &bench->signal);
+    }
+    return NULL;
+}
+
+static void* bench_read(void* arg) {
+    bench_t* bench = (bench_t*)arg;
+    // One write every 64 reads, similar to session lookups vs logins
+    for(size_t i = 0; i < bench->iterations; ++i) {
+        if((i & 63) == 0) {
+            rwlock_write_lock(&bench->rwlock);
+            bench->counter += 1;
+        }
+        else {
+            rwlock_read_lock(&bench->rwlock);
+            (void)bench->counter;
+        }
+        rwlock_unlock(&bench->rwlock);
+    }
+    return NULL;
+}
+
+static void* bench_producer(void* arg) {
+    bench_t* bench = (bench_t*)arg;
+    for(size_t i = 0; i < bench->iterations; ++i) push(bench->queue, (void*)(i + 1));
+    return NULL;
+}
+
+static void* bench_queue(void* arg) {
+    bench_t* bench = (bench_t*)arg;
+    // Every consumer brings its own producer, both go through the same bounded queue
+    pthread_t producer;
+    pthread_create(&producer, NULL, bench_producer, bench);
+    for(size_t i = 0; i < bench->iterations; ++i) (void)pop(bench->queue);
+    pthread_join(producer, NULL);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    size_t max_threads = ((argc > 1) ? strtoul(argv[1], NULL, 10) : 4);
+    size_t iterations = ((argc > 2) ? strtoul(argv[2], NULL, 10) : BENCH_ITERATIONS);
+    if(max_threads == 0 || max_threads > BENCH_MAX_THREADS) max_threads = BENCH_MAX_THREADS;
+
+    bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    lock_init(&bench.lock);
+    signal_init(&bench.signal);
+    rwlock_init(&bench.rwlock);
+    bench.queue = queue_create(1024);
+
+    for(size_t threads = 1; threads <= max_threads; threads *= 2) {
+        bench.threads = threads;
+        bench.iterations = iterations / threads;
+        size_t operations = bench.iterations * threads;
+        bench_run(&bench, "lock/unlock", bench_lock, operations);
+        bench_run(&bench, "unlock_signal (idle)", bench_signal, operations);
+        bench_run(&bench, "rwlock 63:1 read:write", bench_read, operations);
+        if(threads * 2 <= BENCH_MAX_THREADS) {
+            bench_run(&bench, "queue push/pop", bench_queue, operations);
+        }
+    }
+
+    queue_destroy(&bench.queue);
+    rwlock_destroy(&bench.rwlock);
+    signal_destroy(&bench.signal);
+    lock_destroy(&bench.lock);
+    return 0;
+}
@@ -2,6 +2,16 @@
 #include <getopt.h>
 #include "cb.h"
 
+// Build the lock.h futex implementation instead of the pthread one
+static bool futex_locks = false;
+// Per call site lock contention counters
+static bool lock_profile = false;
+
+static void append_lock_flags(cmd_t* cmd) {
+    if(futex_locks) (void)cmd_append_args(cmd, "-DLOCK_FUTEX");
+    if(lock_profile) (void)cmd_append_args(cmd, "-DLOCK_PROFILE");
+}
+
 void setup_build() {
     create_out_dir("build");
     create_out_dir("build/obj");
@@ -35,6 +45,7 @@ void build_async_lib() {
     {
         cmd_t cmd = {0};
         cmd_set_build_tool(&cmd, "gcc");
+        append_lock_flags(&cmd);
         (void)cmd_append_args(&cmd, "-c", "-fPIC", "-O2", "-Wall", "-o");
         (void)cmd_append_paths(&cmd, "libs");
         (void)cmd_append_libs(&cmd, "pthread");
@@ -45,14 +56,14 @@ void build_async_lib() {
         cmd_t cmd = {0};
         cmd_set_build_tool(&cmd, "ar");
         (void)cmd_append_args(&cmd, "rcs", "build/libs/async.a");
-        (void)cmd_append_files(&cmd, "build/obj/libs/async.o", "build/obj/libs/queue.o", "build/obj/libs/threadpool.o");
+        (void)cmd_append_files(&cmd, "build/obj/libs/async.o", "build/obj/libs/queue.o", "build/obj/libs/threadpool.o", "build/obj/libs/reactor.o", "build/obj/libs/lock_profile.o", "build/obj/libs/epoch.o");
         array_append(&builds, build_async(&cmd, NULL));
     }
     {
         cmd_t cmd = {0};
         cmd_set_build_tool(&cmd, "gcc");
         (void)cmd_append_args(&cmd, "-shared", "-fPIC", "-o", "build/libs/async.so");
-        (void)cmd_append_files(&cmd, "build/obj/libs/async.o", "build/obj/libs/queue.o", "build/obj/libs/threadpool.o");
+        (void)cmd_append_files(&cmd, "build/obj/libs/async.o", "build/obj/libs/queue.o", "build/obj/libs/threadpool.o", "build/obj/libs/reactor.o", "build/obj/libs/lock_profile.o", "build/obj/libs/epoch.o");
         array_append(&builds, build_async(&cmd, NULL));
     }
     builds_wait(&builds);
@@ -65,6 +76,7 @@ void build_http_libs() {
 
     cmd_t cmd = {0};
     cmd_set_build_tool(&cmd, "gcc");
+    append_lock_flags(&cmd);
     (void)cmd_append_args(&cmd, "-c", "-O2", "-Wall", "-o");
     (void)cmd_append_paths(&cmd, "libs", "server");
     (void)cmd_append_libs(&cmd, "uuid");
@@ -78,6 +90,7 @@ void build_server() {
     {
         cmd_t cmd = {0};
         cmd_set_build_tool(&cmd, "gcc");
+        append_lock_flags(&cmd);
         (void)cmd_append_args(&cmd, "-c", "-O2", "-Wall", "-o");
         (void)cmd_append_paths(&cmd, "libs");
         (void)cmd_append_libs(&cmd, "ssl");
@@ -99,12 +112,15 @@ void build_app() {
     {
         cmd_t cmd = {0};
         cmd_set_build_tool(&cmd, "gcc");
+        append_lock_flags(&cmd);
         (void)cmd_append_args(&cmd, "-c", "-O2", "-Wall", "-o");
+        (void)cmd_append_paths(&cmd, "libs");
         build_dir_files(&cmd, "app/backend", "build/obj");    
     }
     {
         cmd_t cmd = {0};
         cmd_set_build_tool(&cmd, "gcc");
+        append_lock_flags(&cmd);
         (void)cmd_append_args(&cmd, "-c", "-O2", "-Wall", "-o");
         (void)cmd_append_paths(&cmd, "libs", "server", "http_libs");
         (void)cmd_append_files(&cmd, "app/app.c");
@@ -115,8 +131,8 @@ void build_app() {
         cmd_set_build_tool(&cmd, "gcc");
         (void)cmd_append_args(&cmd, "-o");
         files_append(&cmd.files, "build/obj/", ".o", true);
-        (void)cmd_append_files(&cmd, "build/libs/async.a", "build/libs/server.a");
-        (void)cmd_append_libs(&cmd, "pthread", "ssl", "uuid");
+        (void)cmd_append_files(&cmd, "build/libs/server.a", "build/libs/async.a");
+        (void)cmd_append_libs(&cmd, "pthread", "ssl", "crypto", "uuid");
         build(&cmd, "build/bin/app");
     }
     TMP_CONTEXT_POP();
@@ -133,6 +149,8 @@ int main(int argc, char* argv[]) {
         {"init", no_argument, NULL, 'i'},
         {"sync", no_argument, NULL, 'y'},
         {"run", required_argument, NULL, 'r'},
+        {"futex", no_argument, NULL, 'f'},
+        {"lock-profile", no_argument, NULL, 'l'},
     };
     bool clean = false;
     bool skip = false;
@@ -166,6 +184,12 @@ int main(int argc, char* argv[]) {
         case 't':
             toolkit = optarg;
             break;
+        case 'f':
+            futex_locks = true;
+            break;
+        case 'l':
+            lock_profile = true;
+            break;
         case -1:
             parse = false;
             break;
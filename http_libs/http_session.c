@@ -4,18 +4,43 @@
 #include <uuid/uuid.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
+#include <stdatomic.h>
+
+#include <pthread.h>
 #include <lock.h>
 #include <queue.h>
 #include <async.h>
+#include <epoch.h>
+#include <threadpool.h>
 
 // .server
-//  - .meta
-//    - size_t: users_count
-//  - .users
-//    - name, password
+//  - users.store
+//    - user_store_header_t, padded to USER_STORE_HEADER
+//    - user_t: name, password ("$kdf$cost$salt$hash" in hex, older entries are plain text)
+//  - users.index
+//    - user_index_header_t, padded to USER_STORE_HEADER
+//    - size_t: name index slots
+//  - users.wal
+//    - user_wal_record_t: users registered after the last checkpoint
+//  - sessions.snap
+//    - session_snapshot_header_t
+//    - session_snapshot_record_t: sessions alive when it was saved
+// Older versions kept the users in users.db and their count in .meta.bin, they are moved to users.store once.
+// Version 1 of users.store and its WAL also held a sessions count per user, they are moved aside to users.store.v1
+// and copied into the current layout once
 
 #define INVALID_USER_ID             INVALID_SESSION_ID
 #define SESSION_DEFAULT_TIMEOUT     (60 * 60)       // 1 hour
@@ -23,206 +48,1292 @@
 typedef struct user_t {
     char name[126];
     char password[126];
-    size_t refs;
 }user_t;
 
+// Record of users.db and of version 1 of users.store and the WAL
+typedef struct user_v1_t {
+    char name[126];
+    char password[126];
+    size_t refs;
+}user_v1_t;
+
 typedef struct http_session_t {
-    session_id_t id;
-    size_t expire_s;
+    uuid_t id;
+    // Absolute deadline in seconds, pushed forward without locks every time the session is used
+    _Atomic size_t expire_s;
     size_t user_ref;
+    // Owned by the shard lock: the table entry, the place in the expiry heap and the deadline it is ordered by
+    size_t entry;
+    size_t heap_index;
+    size_t heap_deadline_s;
+    // Unique to each session, tells a cached resolution whether its entry was reused since
+    size_t generation;
 }http_session_t;
 
+// The users and their name index are files mapped in place, so starting does not depend on the number of users.
+// Headers take a whole page so the records after them stay page aligned
+#define USER_STORE_MAGIC        0x52545355u
+#define USER_INDEX_MAGIC        0x58444955u
+#define USER_STORE_VERSION      2
+#define USER_STORE_HEADER       4096
+#define USER_STORE_V1_CHUNK     256
+
+typedef struct user_store_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    // Users made durable by the last checkpoint, the ones registered after it are in the WAL
+    uint64_t count;
+}user_store_header_t;
+
+typedef struct user_index_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t mask;
+    // Users known to be in the index, the ones after them are put again when starting
+    uint64_t count;
+}user_index_header_t;
+
+// Tables are replaced when they grow, readers go through epochs and never take the manager locks.
+// Each table maps the whole store, the old mapping is only removed once no reader can use it
+typedef struct users_table_t {
+    size_t capacity;
+    size_t map_size;
+    uint8_t* map;
+    user_t* users;
+}users_table_t;
+
+// Open addressing index from the user name to its entry, users are never removed so there are no tombstones.
+// Slots hold the entry + 1 so a zeroed index is empty. A crash can leave slots for users that were lost,
+// lookups skip them since their entry is past the last user or holds another name
+#define USER_INDEX_EMPTY        0
+#define USER_INDEX_MIN          64
+
+typedef struct users_index_t {
+    size_t mask;
+    size_t map_size;
+    uint8_t* map;
+    _Atomic size_t* slots;
+}users_index_t;
+
+// Password hashing, see http_session_set_kdf()
+#define USER_KDF_SALT_SIZE          16
+#define USER_KDF_HASH_SIZE          32
+#define USER_KDF_QUEUE              64
+#define USER_KDF_PBKDF2_COST        100000
+#define USER_KDF_SCRYPT_COST        15
+
+// The waiting task and the pool both hold a reference, an interrupted task leaves the job to the pool
+typedef struct user_kdf_job_t {
+    _Atomic int refs;
+    int fd;
+    bool verify;
+    bool result;
+    // Waiting for room in the pool queue, owned by the kdf lock
+    bool parked;
+    struct user_kdf_job_t* next;
+    char password[126];
+    // Hash to verify against or the new one
+    char stored[126];
+}user_kdf_job_t;
+
+// Registrations are appended to the WAL in batches with one fdatasync, the WAL is folded into users.store
+// once it holds USER_WAL_CHECKPOINT records so a restart never replays more than that
+#define USER_WAL_MAGIC              0x4c415755u
+#define USER_WAL_BATCH              64
+#define USER_WAL_QUEUE              (USER_WAL_BATCH * 4)
+#define USER_WAL_CHECKPOINT         4096
+
+typedef struct user_wal_record_t {
+    // CRC-32 of everything after it
+    uint32_t checksum;
+    uint32_t magic;
+    uint64_t entry;
+    user_t user;
+}user_wal_record_t;
+
+typedef struct user_wal_record_v1_t {
+    uint32_t checksum;
+    uint32_t magic;
+    uint64_t entry;
+    user_v1_t user;
+}user_wal_record_v1_t;
+
+// A registration waiting for its record to be durable, the WAL writer and the waiter both hold a reference
+typedef struct user_commit_t {
+    _Atomic int refs;
+    int fd;
+    size_t entry;
+}user_commit_t;
+
+// Sessions only see their deadline change once published, logout and expiry replace them by NULL
+typedef struct sessions_table_t {
+    size_t capacity;
+    _Atomic(http_session_t*) slots[];
+}sessions_table_t;
+
+// Open addressing index from the binary session id to its table entry, linear probing.
+// Slots hold the entry + 1 so a zeroed index is empty, removed entries leave a tombstone behind
+#define SESSION_INDEX_EMPTY     0
+#define SESSION_INDEX_DELETED   SIZE_MAX
+#define SESSION_INDEX_MIN       16
+
+typedef struct sessions_index_t {
+    size_t mask;
+    _Atomic size_t slots[];
+}sessions_index_t;
+
 const size_t SESSIONS_DEFAULT_CAPACITY = 10;
 
+// Stateless sessions carry everything in the cookie, hex encoded and signed with the key kept in server_data.
+// The expiry is wall clock time so tokens stay valid across restarts and between processes sharing the key
+#define SESSION_KEY_SIZE            32
+#define SESSION_REVOKED_MIN         16
+
+typedef struct session_token_t {
+    uint64_t user_ref;
+    uint64_t expire_s;
+    uint8_t nonce[8];
+    uint8_t mac[SHA256_DIGEST_LENGTH];
+}session_token_t;
+
+#define SESSION_TOKEN_LEN           (sizeof(session_token_t) * 2)
+
+// Logged out tokens until they expire, identified by the start of their mac
+typedef struct session_revoked_t {
+    uint64_t tag;
+    uint64_t expire_s;
+}session_revoked_t;
+
+// Live sessions are saved every SESSION_SNAPSHOT_PERIOD seconds, soon after a logout and when stopping, and loaded
+// again when starting so a restart does not log everyone out. Deadlines are saved as wall clock time since the
+// monotonic clock the sessions use restarts with the machine
+#define SESSION_SNAPSHOT_MAGIC      0x50414e53u
+#define SESSION_SNAPSHOT_VERSION    1
+#define SESSION_SNAPSHOT_PERIOD     60
+#define SESSION_SNAPSHOT_MIN        64
+
+typedef struct session_snapshot_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    // CRC-32 of the records
+    uint32_t checksum;
+    uint64_t count;
+}session_snapshot_header_t;
+
+typedef struct session_snapshot_record_t {
+    uuid_t id;
+    uint64_t user_ref;
+    // Hash of the user name, a user lost in a crash can have its entry taken by someone else
+    uint64_t user_hash;
+    uint64_t expire_s;
+}session_snapshot_record_t;
+
+// Sessions are split in shards by their id so logins, logouts and expiry in different shards do not contend.
+// A session_t holds the shard in its low bits and the entry in the shard table above them
+#ifndef SESSION_SHARDS
+    #define SESSION_SHARDS          16
+#endif
+#define SESSION_SHARD_MASK          (SESSION_SHARDS - 1)
+
+_Static_assert((SESSION_SHARDS & SESSION_SHARD_MASK) == 0, "SESSION_SHARDS must be a power of two");
+
+typedef struct sessions_shard_t {
+    // Serializes writers, aligned so neighbour shards do not share its cache line
+    _Alignas(64) lock_t lock;
+    size_t entries;
+    // Free table entries, the lowest ones are on top
+    size_t* free;
+    size_t free_count;
+    _Atomic(sessions_table_t*) table;
+    // Live and deleted index slots, the index is rebuilt once they fill three quarters of it
+    size_t index_used;
+    _Atomic(sessions_index_t*) index;
+    // Min heap ordered by heap_deadline_s, a renewed session is only moved once its old deadline is reached
+    size_t heap_count;
+    http_session_t** heap;
+}sessions_shard_t;
+
 static struct {
-    rwlock_t lock;
+    // Serializes writers
+    lock_t lock;
     char* server_data;
-    FILE* meta_fp;
-    FILE* db_fp;
+    int store_fd;
+    int index_fd;
+    int wal_fd;
+    // Registrations to log, in entry order since they are pushed with the lock held
     queue_t* work;
-    size_t capacity;
+    pthread_t wal_writer;
+    // Pushed last to stop the writer
+    user_commit_t wal_stop;
+    // Only used by the WAL writer once the engine runs
+    size_t checkpointed;
+    size_t wal_records;
     size_t entries;
-    size_t last;
-    user_t* users;
+    // Stored after the user is written, the table holding it is published before
+    _Atomic size_t last;
+    _Atomic(users_table_t*) table;
+    _Atomic(users_index_t*) index;
+    http_session_kdf_t kdf;
+    unsigned kdf_cost;
+    size_t kdf_threads;
+    threadPool_t* kdf_pool;
+    // Owned by the kdf lock. Jobs handed to the pool and not finished yet, the pool is only destroyed once they
+    // are done and no more come, the last one signals kdf_idle
+    lock_t kdf_lock;
+    signal_t kdf_idle;
+    size_t kdf_pending;
+    bool kdf_open;
+    // Jobs of the tasks waiting for room in the pool queue, oldest first
+    user_kdf_job_t* kdf_parked;
+    user_kdf_job_t* kdf_parked_tail;
 }user_manager;
 
 static struct {
-    rwlock_t lock;
     volatile bool running;
     size_t session_timeout;
+    // Seconds clock moved by the session task, the sessions deadlines are based on it
+    _Atomic size_t now_s;
+    // Last session generation handed out
+    _Atomic size_t generation;
+    asyncTimer_t* timer;
     asyncTask_t* worker;
-    size_t capacity;
-    size_t entries;
-    size_t last;
-    http_session_t* sessions;
+    sessions_shard_t shards[SESSION_SHARDS];
+    // Seconds clock deadline of the next snapshot, set when a logout should not wait for it
+    size_t snapshot_s;
+    _Atomic bool snapshot_stale;
+    // Stateless mode, the shards stay empty
+    bool stateless;
+    uint8_t key[SESSION_KEY_SIZE];
+    struct {
+        lock_t lock;
+        // Lets the lookups skip the lock while nothing is revoked
+        _Atomic size_t count;
+        size_t capacity;
+        session_revoked_t* entries;
+    }revoked;
 }session_manager;
 
-/*private:*/ void* session_task(asyncTask_t* self, void* base_entries) {
-    size_t user_entries = (size_t)base_entries;
-    size_t cycle_counter = 0;
-    while(session_manager.running) {
-        // we loop 20 * 50ms to allow faster response to a terminate request
-        if(cycle_counter == 0) cycle_counter = 20;
-        usleep(50000);
-        cycle_counter -= 1;
-        
-        if(cycle_counter == 0) {
-            // Check for expired sessions
-            rwlock_read_lock(&session_manager.lock);
-            size_t buff[session_manager.entries];
-            size_t entries = 0;
-            size_t count = session_manager.entries;
-            for(size_t i = 0; (count > 0) && (i < session_manager.capacity); ++i) {
-                if(session_manager.sessions[i].user_ref != INVALID_USER_ID) {
-                    count -= 1;
-                    if(--session_manager.sessions[i].expire_s == 0) {
-                        buff[entries++] = i;
-                    }
-                }
-            }
-            rwlock_unlock(&session_manager.lock);
-        
-            if(entries > 0) {
-                // Remove expired sessions
-                rwlock_write_lock(&session_manager.lock);
-                while(entries > 0) {
-                    entries -= 1;
-                    http_session_t* session = &session_manager.sessions[buff[entries]];
-                    memset(session->id, 0, sizeof(session->id));
-
-                    rwlock_write_lock(&user_manager.lock);
-                    user_manager.users[session->user_ref].refs -= 1;
-                    rwlock_unlock(&user_manager.lock);
-
-                    session->user_ref = INVALID_USER_ID;
-                    if(entries == (session_manager.last - 1)) session_manager.last -= 1;
-                }
-                rwlock_unlock(&session_manager.lock);
-            }
+/*private:*/ void* user_map(int fd, size_t size) {
+    struct stat st;
+    // Files only grow, the mapping covers the new part once the file does
+    if(fstat(fd, &st) != 0) return NULL;
+    if((size_t)st.st_size < size && ftruncate(fd, (off_t)size) != 0) return NULL;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return ((map == MAP_FAILED) ? NULL : map);
+}
+
+/*private:*/ users_table_t* users_table_map(int fd, size_t capacity) {
+    size_t map_size = USER_STORE_HEADER + sizeof(user_t) * capacity;
+    uint8_t* map = user_map(fd, map_size);
+    if(map == NULL) return NULL;
+    users_table_t* table = malloc(sizeof(users_table_t));
+    table->capacity = capacity;
+    table->map_size = map_size;
+    table->map = map;
+    table->users = (user_t*)(map + USER_STORE_HEADER);
+    return table;
+}
+
+/*private:*/ void users_table_release(void* arg) {
+    users_table_t* table = (users_table_t*)arg;
+    munmap(table->map, table->map_size);
+    free(table);
+}
+
+/*private:*/ user_store_header_t* user_store_header(users_table_t* table) {
+    return (user_store_header_t*)table->map;
+}
+
+/*private:*/ users_index_t* users_index_map(int fd, size_t capacity) {
+    size_t map_size = USER_STORE_HEADER + sizeof(size_t) * capacity;
+    uint8_t* map = user_map(fd, map_size);
+    if(map == NULL) return NULL;
+    users_index_t* index = malloc(sizeof(users_index_t));
+    index->mask = capacity - 1;
+    index->map_size = map_size;
+    index->map = map;
+    index->slots = (_Atomic size_t*)(map + USER_STORE_HEADER);
+    return index;
+}
+
+/*private:*/ void users_index_release(void* arg) {
+    users_index_t* index = (users_index_t*)arg;
+    munmap(index->map, index->map_size);
+    free(index);
+}
+
+/*private:*/ user_index_header_t* user_index_header(users_index_t* index) {
+    return (user_index_header_t*)index->map;
+}
+
+/*private:*/ void user_db_path(const char* name, /*out*/char* path) {
+    snprintf(path, 256, "%s%s", user_manager.server_data, name);
+}
+
+// FNV-1a
+/*private:*/ size_t user_hash(const char* name) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(; *name; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 0x100000001b3ull;
+    }
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+// Called with the user lock held. Putting an entry the index already holds does nothing, starting
+// puts the users after the index count again and some of them can already be in the mapped file
+/*private:*/ void user_index_put(users_index_t* index, const char* name, size_t entry) {
+    size_t i = user_hash(name) & index->mask;
+    for(size_t slot; (slot = atomic_load(&index->slots[i])) != USER_INDEX_EMPTY; i = (i + 1) & index->mask) {
+        if(slot == entry + 1) return;
+    }
+    atomic_store_explicit(&index->slots[i], entry + 1, memory_order_release);
+}
+
+// Called with the user lock held or before the engine runs, sized for a load under one half.
+// The new index is written aside and renamed over the old one once complete
+/*private:*/ void user_index_rebuild(users_table_t* table, size_t entries) {
+    size_t capacity = USER_INDEX_MIN;
+    while(capacity < (entries + 1) * 2) capacity *= 2;
+    char path[256], temp_path[256];
+    user_db_path("users.index", path);
+    user_db_path("users.index.new", temp_path);
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    users_index_t* index = ((fd < 0) ? NULL : users_index_map(fd, capacity));
+    if(index == NULL) {
+        printf("\nERROR in user_index_rebuild: could not create users.index\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t entry = 0; entry < entries; ++entry) {
+        user_index_put(index, table->users[entry].name, entry);
+    }
+    // Counted by the next checkpoint, once the slots are known to be on disk
+    *user_index_header(index) = (user_index_header_t){USER_INDEX_MAGIC, USER_STORE_VERSION, index->mask, 0};
+    rename(temp_path, path);
+
+    users_index_t* old = atomic_load(&user_manager.index);
+    atomic_store(&user_manager.index, index);
+    if(old != NULL) {
+        close(user_manager.index_fd);
+        epoch_retire(old, users_index_release);
+    }
+    user_manager.index_fd = fd;
+}
+
+/*private:*/ sessions_table_t* sessions_table_create(size_t capacity) {
+    sessions_table_t* table = calloc(1, sizeof(sessions_table_t) + sizeof(_Atomic(http_session_t*)) * capacity);
+    table->capacity = capacity;
+    return table;
+}
+
+/*private:*/ sessions_index_t* sessions_index_create(size_t capacity) {
+    sessions_index_t* index = calloc(1, sizeof(sessions_index_t) + sizeof(_Atomic size_t) * capacity);
+    index->mask = capacity - 1;
+    return index;
+}
+
+// The ids are random so any 64 bits of them are already well spread, the mix only breaks up the fixed version bits
+/*private:*/ size_t session_hash(const uuid_t id) {
+    uint64_t hash;
+    memcpy(&hash, id, sizeof(hash));
+    hash *= 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+// Taken from the other half of the id so the sessions of a shard still spread over its whole index
+/*private:*/ sessions_shard_t* session_shard_of(const uuid_t id) {
+    uint64_t hash;
+    memcpy(&hash, id + sizeof(hash), sizeof(hash));
+    hash *= 0x9E3779B97F4A7C15ull;
+    return &session_manager.shards[(hash >> 32) & SESSION_SHARD_MASK];
+}
+
+/*private:*/ sessions_shard_t* session_shard(session_t session) {
+    return &session_manager.shards[session & SESSION_SHARD_MASK];
+}
+
+/*private:*/ size_t session_entry(session_t session) {
+    return session / SESSION_SHARDS;
+}
+
+/*private:*/ session_t session_make(sessions_shard_t* shard, size_t entry) {
+    return (session_t)(entry * SESSION_SHARDS + (size_t)(shard - session_manager.shards));
+}
+
+// Called in an epoch, returns the session entry in the shard
+/*private:*/ size_t session_index_find(sessions_shard_t* shard, const uuid_t id) {
+    sessions_table_t* table = atomic_load(&shard->table);
+    sessions_index_t* index = atomic_load(&shard->index);
+    for(size_t i = session_hash(id) & index->mask; ; i = (i + 1) & index->mask) {
+        size_t slot = atomic_load_explicit(&index->slots[i], memory_order_acquire);
+        if(slot == SESSION_INDEX_EMPTY) return INVALID_SESSION_ID;
+        if(slot == SESSION_INDEX_DELETED || slot > table->capacity) continue;
+        http_session_t* session = atomic_load(&table->slots[slot - 1]);
+        if(session != NULL && memcmp(session->id, id, sizeof(uuid_t)) == 0) return slot - 1;
+    }
+}
+
+// Called with the shard lock held
+/*private:*/ void session_index_put(sessions_shard_t* shard, sessions_index_t* index, const uuid_t id, size_t entry) {
+    size_t i;
+    for(i = session_hash(id) & index->mask; ; i = (i + 1) & index->mask) {
+        size_t slot = atomic_load(&index->slots[i]);
+        if(slot == SESSION_INDEX_EMPTY || slot == SESSION_INDEX_DELETED) break;
+    }
+    if(atomic_load(&index->slots[i]) == SESSION_INDEX_EMPTY) shard->index_used += 1;
+    atomic_store_explicit(&index->slots[i], entry + 1, memory_order_release);
+}
+
+// Called with the shard lock held, the new index drops the tombstones and keeps the load under a half
+/*private:*/ void session_index_rebuild(sessions_shard_t* shard, sessions_table_t* table) {
+    size_t capacity = SESSION_INDEX_MIN;
+    while(capacity < (shard->entries + 1) * 4) capacity *= 2;
+    sessions_index_t* index = sessions_index_create(capacity);
+    shard->index_used = 0;
+    for(size_t entry = 0; entry < table->capacity; ++entry) {
+        http_session_t* session = atomic_load(&table->slots[entry]);
+        if(session != NULL) session_index_put(shard, index, session->id, entry);
+    }
+    sessions_index_t* old = atomic_load(&shard->index);
+    atomic_store(&shard->index, index);
+    epoch_retire(old, NULL);
+}
+
+// Called with the shard lock held
+/*private:*/ void session_index_remove(sessions_shard_t* shard, const uuid_t id, size_t entry) {
+    sessions_index_t* index = atomic_load(&shard->index);
+    for(size_t i = session_hash(id) & index->mask; ; i = (i + 1) & index->mask) {
+        size_t slot = atomic_load(&index->slots[i]);
+        if(slot == SESSION_INDEX_EMPTY) return;
+        if(slot == entry + 1) {
+            atomic_store(&index->slots[i], SESSION_INDEX_DELETED);
+            return;
         }
-        
-        if(!session_manager.running || cycle_counter == 0) {
-            size_t new_entries = 0;
-            while(!empty(user_manager.work)) {
-                size_t user_id = (size_t)pop(user_manager.work);
-
-                rwlock_read_lock(&user_manager.lock);
-                fwrite(&user_manager.users[user_id], sizeof(user_t), 1, user_manager.db_fp);
-                rwlock_unlock(&user_manager.lock);
-
-                fflush(user_manager.db_fp);
-                new_entries += 1;
-            }
-            if(new_entries > 0) {
-                user_entries += new_entries;
-                fseek(user_manager.meta_fp, 0, SEEK_SET);
-                fwrite(&user_entries, sizeof(user_entries), 1, user_manager.meta_fp);
-                fflush(user_manager.meta_fp);
-            }
+    }
+}
+
+/*private:*/ size_t session_clock_s() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (size_t)now.tv_sec;
+}
+
+/*private:*/ void session_heap_swap(sessions_shard_t* shard, size_t a, size_t b) {
+    http_session_t* temp = shard->heap[a];
+    shard->heap[a] = shard->heap[b];
+    shard->heap[b] = temp;
+    shard->heap[a]->heap_index = a;
+    shard->heap[b]->heap_index = b;
+}
+
+/*private:*/ void session_heap_up(sessions_shard_t* shard, size_t i) {
+    while(i > 0 && shard->heap[(i - 1) / 2]->heap_deadline_s > shard->heap[i]->heap_deadline_s) {
+        session_heap_swap(shard, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/*private:*/ void session_heap_down(sessions_shard_t* shard, size_t i) {
+    while(true) {
+        size_t min = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if(left < shard->heap_count && shard->heap[left]->heap_deadline_s < shard->heap[min]->heap_deadline_s) min = left;
+        if(right < shard->heap_count && shard->heap[right]->heap_deadline_s < shard->heap[min]->heap_deadline_s) min = right;
+        if(min == i) break;
+        session_heap_swap(shard, i, min);
+        i = min;
+    }
+}
+
+// Called with the shard lock held, the heap always has room for every table entry
+/*private:*/ void session_heap_add(sessions_shard_t* shard, http_session_t* session) {
+    session->heap_deadline_s = atomic_load(&session->expire_s);
+    session->heap_index = shard->heap_count++;
+    shard->heap[session->heap_index] = session;
+    session_heap_up(shard, session->heap_index);
+}
+
+// Called with the shard lock held
+/*private:*/ void session_heap_remove(sessions_shard_t* shard, http_session_t* session) {
+    size_t i = session->heap_index;
+    shard->heap_count -= 1;
+    if(i != shard->heap_count) {
+        shard->heap[i] = shard->heap[shard->heap_count];
+        shard->heap[i]->heap_index = i;
+        session_heap_down(shard, i);
+        session_heap_up(shard, i);
+    }
+}
+
+// Called in an epoch, NULL when the session is no longer there
+/*private:*/ http_session_t* session_lookup(session_t session) {
+    sessions_table_t* table = atomic_load(&session_shard(session)->table);
+    size_t entry = session_entry(session);
+    return ((entry < table->capacity) ? atomic_load(&table->slots[entry]) : NULL);
+}
+
+// Called with the shard lock held, the session is released once no reader can see it
+/*private:*/ void session_remove(sessions_shard_t* shard, sessions_table_t* table, size_t entry) {
+    http_session_t* session = atomic_exchange(&table->slots[entry], NULL);
+    session_index_remove(shard, session->id, entry);
+    session_heap_remove(shard, session);
+    shard->entries -= 1;
+    shard->free[shard->free_count++] = entry;
+    epoch_retire(session, NULL);
+}
+
+// Called with the shard lock held, makes room for one more session
+/*private:*/ sessions_table_t* session_shard_grow(sessions_shard_t* shard) {
+    sessions_table_t* table = atomic_load(&shard->table);
+    if(shard->free_count > 0) return table;
+    // Readers keep using the old table until they leave their epoch. Entries keep their place so the index stays valid
+    sessions_table_t* new_table = sessions_table_create(table->capacity * 2);
+    for(size_t i = 0; i < table->capacity; ++i) {
+        atomic_init(&new_table->slots[i], atomic_load(&table->slots[i]));
+    }
+    shard->free = realloc(shard->free, sizeof(size_t) * new_table->capacity);
+    shard->heap = realloc(shard->heap, sizeof(http_session_t*) * new_table->capacity);
+    for(size_t i = new_table->capacity; i > table->capacity; --i) {
+        shard->free[shard->free_count++] = i - 1;
+    }
+    atomic_store(&shard->table, new_table);
+    epoch_retire(table, NULL);
+    return new_table;
+}
+
+// Only the sessions at the top of the heap are looked at, the renewed ones are moved to their new deadline
+/*private:*/ void session_shard_expire(sessions_shard_t* shard, size_t now) {
+    lock(&shard->lock);
+    sessions_table_t* table = atomic_load(&shard->table);
+    while(shard->heap_count > 0 && shard->heap[0]->heap_deadline_s <= now) {
+        http_session_t* session = shard->heap[0];
+        size_t expire = atomic_load_explicit(&session->expire_s, memory_order_relaxed);
+        if(expire > now) {
+            session->heap_deadline_s = expire;
+            session_heap_down(shard, 0);
+        }
+        else {
+            session_remove(shard, table, session->entry);
         }
-        if(!session_manager.running) printf("\nSession task is out....\n");
     }
+    unlock(&shard->lock);
+}
+
+// Inserts a complete session in its shard, the user already counts it
+/*private:*/ session_t session_publish(http_session_t* session) {
+    session->generation = atomic_fetch_add(&session_manager.generation, 1) + 1;
+    sessions_shard_t* shard = session_shard_of(session->id);
+    lock(&shard->lock);
+    sessions_table_t* table = session_shard_grow(shard);
+    size_t entry = shard->free[--shard->free_count];
+    session->entry = entry;
+    session_heap_add(shard, session);
+    atomic_store(&table->slots[entry], session);
+    shard->entries += 1;
+    if((shard->index_used + 1) * 4 > (atomic_load(&shard->index)->mask + 1) * 3) {
+        session_index_rebuild(shard, table);
+    }
+    else {
+        session_index_put(shard, atomic_load(&shard->index), session->id, entry);
+    }
+    unlock(&shard->lock);
+    return session_make(shard, entry);
+}
+
+/*private:*/ void session_token_sign(const session_token_t* token, /*out*/uint8_t* mac) {
+    unsigned int len = SHA256_DIGEST_LENGTH;
+    HMAC(EVP_sha256(), session_manager.key, SESSION_KEY_SIZE, (const uint8_t*)token, offsetof(session_token_t, mac), mac, &len);
+}
+
+/*private:*/ uint64_t session_token_tag(const session_token_t* token) {
+    uint64_t tag;
+    memcpy(&tag, token->mac, sizeof(tag));
+    return tag;
+}
+
+/*private:*/ bool session_token_revoked(const session_token_t* token) {
+    if(atomic_load(&session_manager.revoked.count) == 0) return false;
+    uint64_t tag = session_token_tag(token);
+    bool revoked = false;
+    lock(&session_manager.revoked.lock);
+    for(size_t i = 0; i < session_manager.revoked.count && !revoked; ++i) {
+        revoked = (session_manager.revoked.entries[i].tag == tag);
+    }
+    unlock(&session_manager.revoked.lock);
+    return revoked;
+}
+
+/*private:*/ void session_token_revoke(const session_token_t* token) {
+    lock(&session_manager.revoked.lock);
+    size_t count = atomic_load(&session_manager.revoked.count);
+    if(count == session_manager.revoked.capacity) {
+        session_manager.revoked.capacity *= 2;
+        session_manager.revoked.entries = realloc(session_manager.revoked.entries, sizeof(session_revoked_t) * session_manager.revoked.capacity);
+    }
+    session_manager.revoked.entries[count] = (session_revoked_t){session_token_tag(token), token->expire_s};
+    atomic_store(&session_manager.revoked.count, count + 1);
+    unlock(&session_manager.revoked.lock);
+}
+
+// Expired tokens are rejected anyway, so they can leave the revocation list
+/*private:*/ void session_revoked_prune(uint64_t now) {
+    if(atomic_load(&session_manager.revoked.count) == 0) return;
+    lock(&session_manager.revoked.lock);
+    size_t count = 0;
+    for(size_t i = 0; i < atomic_load(&session_manager.revoked.count); ++i) {
+        if(session_manager.revoked.entries[i].expire_s > now) {
+            session_manager.revoked.entries[count++] = session_manager.revoked.entries[i];
+        }
+    }
+    atomic_store(&session_manager.revoked.count, count);
+    unlock(&session_manager.revoked.lock);
+}
+
+/*private:*/ int session_hex_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// The cookie is not terminated, it points inside the request
+/*private:*/ bool session_token_parse(const char* cookie, /*out*/session_token_t* token) {
+    uint8_t* raw = (uint8_t*)token;
+    for(size_t i = 0; i < sizeof(session_token_t); ++i) {
+        int high = session_hex_value(cookie[i * 2]);
+        if(high < 0) return false;
+        int low = session_hex_value(cookie[i * 2 + 1]);
+        if(low < 0) return false;
+        raw[i] = (uint8_t)((high << 4) | low);
+    }
+    if(session_hex_value(cookie[SESSION_TOKEN_LEN]) >= 0) return false;
+
+    uint8_t mac[SHA256_DIGEST_LENGTH];
+    session_token_sign(token, mac);
+    if(CRYPTO_memcmp(mac, token->mac, sizeof(mac)) != 0) return false;
+    return (token->expire_s > (uint64_t)time(NULL) && token->user_ref < atomic_load(&user_manager.last));
+}
+
+// Reuses the key other processes or previous runs already created
+/*private:*/ int session_key_load(const char* server_data) {
+    char path[256];
+    snprintf(path, sizeof(path), "%ssession.key", server_data);
+    int fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+        ssize_t len = read(fd, session_manager.key, SESSION_KEY_SIZE);
+        close(fd);
+        return ((len == SESSION_KEY_SIZE) ? 0 : -1);
+    }
+    if(RAND_bytes(session_manager.key, SESSION_KEY_SIZE) != 1) return -1;
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        // Someone else created it first
+        return ((errno == EEXIST) ? session_key_load(server_data) : -1);
+    }
+    ssize_t len = write(fd, session_manager.key, SESSION_KEY_SIZE);
+    close(fd);
+    return ((len == SESSION_KEY_SIZE) ? 0 : -1);
+}
+
+/*private:*/ bool user_kdf_derive(http_session_kdf_t kdf, unsigned cost, const char* password, const uint8_t* salt, /*out*/uint8_t* hash) {
+    if(kdf == HTTP_SESSION_KDF_SCRYPT) {
+        if(cost == 0 || cost > 30) return false;
+        uint64_t n = (1ull << cost);
+        // scrypt needs 128 * r * N bytes, leave it some room
+        return (EVP_PBE_scrypt(password, strlen(password), salt, USER_KDF_SALT_SIZE, n, 8, 1, 256 * 8 * n,
+            hash, USER_KDF_HASH_SIZE) == 1);
+    }
+    return (PKCS5_PBKDF2_HMAC(password, strlen(password), salt, USER_KDF_SALT_SIZE, (int)cost, EVP_sha256(),
+        USER_KDF_HASH_SIZE, hash) == 1);
+}
+
+/*private:*/ void user_hex_encode(const uint8_t* data, size_t size, /*out*/char* hex) {
+    for(size_t i = 0; i < size; ++i) {
+        sprintf(hex + i * 2, "%02x", data[i]);
+    }
+}
+
+/*private:*/ bool user_hex_decode(const char* hex, size_t size, /*out*/uint8_t* data) {
+    for(size_t i = 0; i < size; ++i) {
+        int high = session_hex_value(hex[i * 2]);
+        int low = ((high < 0) ? -1 : session_hex_value(hex[i * 2 + 1]));
+        if(low < 0) return false;
+        data[i] = (uint8_t)((high << 4) | low);
+    }
+    return true;
+}
+
+/*private:*/ bool user_kdf_hash(const char* password, /*out*/char* stored) {
+    uint8_t salt[USER_KDF_SALT_SIZE];
+    uint8_t hash[USER_KDF_HASH_SIZE];
+    if(RAND_bytes(salt, sizeof(salt)) != 1) return false;
+    if(!user_kdf_derive(user_manager.kdf, user_manager.kdf_cost, password, salt, hash)) return false;
+    int len = sprintf(stored, "$%s$%u$", ((user_manager.kdf == HTTP_SESSION_KDF_SCRYPT) ? "scrypt" : "pbkdf2"), user_manager.kdf_cost);
+    user_hex_encode(salt, sizeof(salt), stored + len);
+    stored[len + sizeof(salt) * 2] = '$';
+    user_hex_encode(hash, sizeof(hash), stored + len + sizeof(salt) * 2 + 1);
+    OPENSSL_cleanse(hash, sizeof(hash));
+    return true;
+}
+
+/*private:*/ bool user_kdf_verify(const char* password, const char* stored) {
+    // Users registered before the passwords were hashed
+    if(stored[0] != '$') return (strcmp(stored, password) == 0);
+
+    http_session_kdf_t kdf;
+    if(strncmp(stored, "$pbkdf2$", sizeof("$pbkdf2$") - 1) == 0) kdf = HTTP_SESSION_KDF_PBKDF2;
+    else if(strncmp(stored, "$scrypt$", sizeof("$scrypt$") - 1) == 0) kdf = HTTP_SESSION_KDF_SCRYPT;
+    else return false;
+    char* salt_hex;
+    unsigned long cost = strtoul(stored + sizeof("$pbkdf2$") - 1, &salt_hex, 10);
+    uint8_t salt[USER_KDF_SALT_SIZE];
+    uint8_t expected[USER_KDF_HASH_SIZE];
+    if(salt_hex[0] != '$' || !user_hex_decode(salt_hex + 1, sizeof(salt), salt)) return false;
+    if(salt_hex[1 + sizeof(salt) * 2] != '$' || !user_hex_decode(salt_hex + 2 + sizeof(salt) * 2, sizeof(expected), expected)) return false;
+
+    uint8_t hash[USER_KDF_HASH_SIZE];
+    bool valid = (user_kdf_derive(kdf, (unsigned)cost, password, salt, hash) && CRYPTO_memcmp(hash, expected, sizeof(hash)) == 0);
+    OPENSSL_cleanse(hash, sizeof(hash));
+    return valid;
+}
+
+/*private:*/ void user_kdf_release(user_kdf_job_t* job) {
+    if(atomic_fetch_sub(&job->refs, 1) != 1) return;
+    if(job->fd >= 0) close(job->fd);
+    OPENSSL_cleanse(job, sizeof(*job));
+    free(job);
+}
+
+// Called with the kdf lock held
+/*private:*/ void user_kdf_park(user_kdf_job_t* job) {
+    job->parked = true;
+    job->next = NULL;
+    if(user_manager.kdf_parked_tail != NULL) user_manager.kdf_parked_tail->next = job;
+    else user_manager.kdf_parked = job;
+    user_manager.kdf_parked_tail = job;
+}
+
+// Called with the kdf lock held
+/*private:*/ void user_kdf_unpark(user_kdf_job_t* job) {
+    user_kdf_job_t** link = &user_manager.kdf_parked;
+    user_kdf_job_t* prev = NULL;
+    while(*link != job) {
+        prev = *link;
+        link = &prev->next;
+    }
+    *link = job->next;
+    if(user_manager.kdf_parked_tail == job) user_manager.kdf_parked_tail = prev;
+    job->parked = false;
+}
+
+// Called with the kdf lock held, the oldest parked task retries its push
+/*private:*/ void user_kdf_wake_parked() {
+    user_kdf_job_t* job = user_manager.kdf_parked;
+    if(job == NULL) return;
+    user_kdf_unpark(job);
+    eventfd_write(job->fd, 1);
+}
+
+// Called with the kdf lock held, unlocks it
+/*private:*/ void user_kdf_finish() {
+    user_manager.kdf_pending -= 1;
+    if(user_manager.kdf_pending == 0 && !user_manager.kdf_open) unlock_signal(&user_manager.kdf_lock, &user_manager.kdf_idle);
+    else unlock(&user_manager.kdf_lock);
+}
+
+/*private:*/ void* user_kdf_work(void* arg) {
+    user_kdf_job_t* job = (user_kdf_job_t*)arg;
+    // The pool handed the queue entry of the job back before running it
+    lock(&user_manager.kdf_lock);
+    user_kdf_wake_parked();
+    unlock(&user_manager.kdf_lock);
+
+    if(job->verify) job->result = user_kdf_verify(job->password, job->stored);
+    else job->result = user_kdf_hash(job->password, job->stored);
+    eventfd_write(job->fd, 1);
+    user_kdf_release(job);
+    lock(&user_manager.kdf_lock);
+    user_kdf_finish();
     return NULL;
 }
 
-/* private: */ size_t user_get(const char* name, bool lock) {
-    if(lock) rwlock_read_lock(&user_manager.lock);
-    for(size_t entry = 0; entry < user_manager.last; ++entry) {
-        if(strcmp(user_manager.users[entry].name, name) == 0){
-            if(lock) rwlock_unlock(&user_manager.lock);
-            return entry; // unlock
+// Waits for fd to be signaled, suspending the calling task if there is one. False when the task was interrupted first
+/*private:*/ bool user_wait(int fd) {
+    asyncTask_t* task = async_self();
+    if(task == NULL) {
+        eventfd_t value;
+        return (eventfd_read(fd, &value) == 0);
+    }
+    return (await_readable(task, fd) == EAsync_Success);
+}
+
+// Runs the job on the kdf pool and waits for it, suspending the calling task if there is one.
+// Returns false when the task was interrupted before the job finished
+/*private:*/ bool user_kdf_run(user_kdf_job_t* job) {
+    atomic_init(&job->refs, 1);
+    job->fd = eventfd(0, EFD_CLOEXEC);
+    if(job->fd < 0) return false;
+
+    // Counted under the lock the engine stop closes the pool with, so the stop either waits for the job or it is refused
+    lock(&user_manager.kdf_lock);
+    if(!user_manager.kdf_open) {
+        unlock(&user_manager.kdf_lock);
+        return false;
+    }
+    user_manager.kdf_pending += 1;
+
+    asyncTask_t* task = async_self();
+    atomic_store(&job->refs, 2);
+    if(task == NULL) {
+        unlock(&user_manager.kdf_lock);
+        threadPool_pushWork(user_manager.kdf_pool, user_kdf_work, job);
+        return user_wait(job->fd);
+    }
+    // The pool queue is bounded, a full one means a login storm. The task is parked without holding its worker
+    // until a job leaving the queue wakes it, it is checked under the same lock so that wake is never missed
+    while(!threadPool_tryPushWorkPriority(user_manager.kdf_pool, THREADPOOL_DEFAULT_PRIORITY, user_kdf_work, job)) {
+        user_kdf_park(job);
+        unlock(&user_manager.kdf_lock);
+        bool woken = user_wait(job->fd);
+        lock(&user_manager.kdf_lock);
+        if(!woken) {
+            // Woken and interrupted at once, the room it was given goes to the next one
+            if(job->parked) user_kdf_unpark(job);
+            else user_kdf_wake_parked();
+            atomic_store(&job->refs, 1);
+            user_kdf_finish();
+            return false;
         }
+        eventfd_t value;
+        (void)eventfd_read(job->fd, &value);
     }
-    if(lock) rwlock_unlock(&user_manager.lock);
-    return INVALID_USER_ID;
+    unlock(&user_manager.kdf_lock);
+    return user_wait(job->fd);
 }
 
-/* private: */ session_t http_session_get_by_id(const session_id_t id) {
-    rwlock_read_lock(&session_manager.lock);
-    for(size_t i = 0; i < session_manager.capacity; ++i) {
-        if(session_manager.sessions[i].id[0] != 0 && strcmp(session_manager.sessions[i].id, id) == 0) {
-            rwlock_unlock(&session_manager.lock);
-            return (session_t)i;
+// CRC-32 (IEEE), records are small and written once so the bitwise form is enough
+/*private:*/ uint32_t user_wal_crc(const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    for(size_t i = 0; i < size; ++i) {
+        crc ^= bytes[i];
+        for(int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
         }
     }
-    rwlock_unlock(&session_manager.lock);
-    return INVALID_SESSION_ID;
+    return ~crc;
 }
 
-bool http_session_register_user(const char* name, const char *password) {
-    // Note: we have to write lock it here to ensure that a parallel request does not register the same user name
-    //       and we will have to keep it locked until the users[] is updated for the same reason
-    //       to free the lock as soon as possible the write back to the file db will be done in the session task
-    rwlock_write_lock(&user_manager.lock);
-    if(user_get(name, false) != INVALID_USER_ID) return false; // unlock
+/*private:*/ uint32_t user_wal_checksum(const user_wal_record_t* record) {
+    return user_wal_crc(&record->magic, sizeof(*record) - offsetof(user_wal_record_t, magic));
+}
 
-    size_t entry;
-    if(user_manager.entries < user_manager.capacity) {
-        for(entry = 0; entry < user_manager.last; ++entry) {
-            if(user_manager.users[entry].name[0] == 0) break;
+/*private:*/ bool user_write_all(int fd, const void* data, size_t size, off_t offset) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    while(size > 0) {
+        ssize_t len = ((offset < 0) ? write(fd, bytes, size) : pwrite(fd, bytes, size, offset));
+        if(len < 0 && errno == EINTR) continue;
+        if(len <= 0) return false;
+        bytes += len;
+        size -= (size_t)len;
+        if(offset >= 0) offset += len;
+    }
+    return true;
+}
+
+// Sessions are copied one shard at a time and written outside the locks, the file is replaced once complete
+/*private:*/ void session_snapshot_save() {
+    if(session_manager.stateless) return;
+    size_t now = atomic_load(&session_manager.now_s);
+    uint64_t wall = (uint64_t)time(NULL);
+    size_t count = 0;
+    size_t capacity = SESSION_SNAPSHOT_MIN;
+    session_snapshot_record_t* records = malloc(sizeof(session_snapshot_record_t) * capacity);
+    for(size_t s = 0; s < SESSION_SHARDS; ++s) {
+        sessions_shard_t* shard = &session_manager.shards[s];
+        lock(&shard->lock);
+        if(count + shard->heap_count > capacity) {
+            while(count + shard->heap_count > capacity) capacity *= 2;
+            records = realloc(records, sizeof(session_snapshot_record_t) * capacity);
+        }
+        // The heap holds every live session
+        for(size_t i = 0; i < shard->heap_count; ++i) {
+            http_session_t* session = shard->heap[i];
+            size_t expire = atomic_load_explicit(&session->expire_s, memory_order_relaxed);
+            if(expire <= now) continue;
+            session_snapshot_record_t* record = &records[count++];
+            memcpy(record->id, session->id, sizeof(uuid_t));
+            record->user_ref = session->user_ref;
+            record->user_hash = 0;
+            record->expire_s = wall + (expire - now);
         }
+        unlock(&shard->lock);
     }
-    else {
-        entry = user_manager.last;
-        // Expand the users array
-        user_manager.capacity *= 2;
-        user_manager.users = (user_t*)realloc(user_manager.users, sizeof(user_t) * user_manager.capacity);
-        memset(&user_manager.users[user_manager.last], 0, sizeof(user_t) * (user_manager.capacity - session_manager.last));
+    epoch_enter();
+    users_table_t* table = atomic_load(&user_manager.table);
+    for(size_t i = 0; i < count; ++i) {
+        records[i].user_hash = user_hash(table->users[records[i].user_ref].name);
     }
+    epoch_exit();
 
-    user_t* user = &user_manager.users[entry];
-    if(entry == user_manager.last) user_manager.last += 1;
-    user_manager.entries += 1;
+    session_snapshot_header_t header = {SESSION_SNAPSHOT_MAGIC, SESSION_SNAPSHOT_VERSION, sizeof(session_snapshot_record_t),
+        user_wal_crc(records, sizeof(session_snapshot_record_t) * count), count};
+    char path[256], temp_path[256];
+    user_db_path("sessions.snap", path);
+    user_db_path("sessions.snap.new", temp_path);
+    // The ids are as good as the passwords
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool saved = (fd >= 0 && user_write_all(fd, &header, sizeof(header), -1) &&
+        user_write_all(fd, records, sizeof(session_snapshot_record_t) * count, -1) && fdatasync(fd) == 0);
+    if(fd >= 0) close(fd);
+    if(saved) saved = (rename(temp_path, path) == 0);
+    if(!saved) {
+        printf("\nERROR in session_snapshot_save: sessions.snap could not be written\n");
+        unlink(temp_path);
+    }
+    free(records);
+}
+
+// Called before the session task runs, once the users are loaded
+/*private:*/ void session_snapshot_load() {
+    if(session_manager.stateless) return;
+    char path[256];
+    user_db_path("sessions.snap", path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return;
+    session_snapshot_header_t header;
+    session_snapshot_record_t* records = NULL;
+    struct stat st;
+    bool valid = (fstat(fd, &st) == 0 && read(fd, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == SESSION_SNAPSHOT_MAGIC && header.version == SESSION_SNAPSHOT_VERSION &&
+        header.record_size == sizeof(session_snapshot_record_t) &&
+        header.count == ((size_t)st.st_size - sizeof(header)) / sizeof(session_snapshot_record_t));
+    if(valid) {
+        size_t size = sizeof(session_snapshot_record_t) * header.count;
+        records = malloc(size);
+        valid = (records != NULL && read(fd, records, size) == (ssize_t)size && user_wal_crc(records, size) == header.checksum);
+    }
+    close(fd);
+    if(!valid) {
+        printf("\nERROR in session_snapshot_load: sessions.snap is not valid, starting without sessions\n");
+        free(records);
+        return;
+    }
 
-    strncpy(user->name, name, sizeof(user->name));
-    strncpy(user->password, password, sizeof(user->password));
-    rwlock_unlock(&user_manager.lock);
+    size_t now = atomic_load(&session_manager.now_s);
+    uint64_t wall = (uint64_t)time(NULL);
+    size_t restored = 0;
+    users_table_t* table = atomic_load(&user_manager.table);
+    for(size_t i = 0; i < header.count; ++i) {
+        session_snapshot_record_t* record = &records[i];
+        if(record->expire_s <= wall || record->user_ref >= atomic_load(&user_manager.last)) continue;
+        if(user_hash(table->users[record->user_ref].name) != record->user_hash) continue;
+        http_session_t* session = malloc(sizeof(http_session_t));
+        memcpy(session->id, record->id, sizeof(uuid_t));
+        session->user_ref = record->user_ref;
+        atomic_init(&session->expire_s, now + (size_t)(record->expire_s - wall));
+        session_publish(session);
+        restored += 1;
+    }
+    free(records);
+    if(restored > 0) printf("\nRestored %zu sessions\n", restored);
+}
 
-    // Send the db managing work to be done in the session task
-    push(user_manager.work, (void*)entry);
+/*private:*/ void* session_task(asyncTask_t* self, void* arg) {
+    // The task is only resumed once per second, the timer is stopped to request its termination
+    while(async_timer_wait(self, session_manager.timer)) {
+        // Check for expired sessions one shard at a time
+        size_t now = session_clock_s();
+        atomic_store(&session_manager.now_s, now);
+        for(size_t i = 0; i < SESSION_SHARDS; ++i) {
+            session_shard_expire(&session_manager.shards[i], now);
+        }
+        session_revoked_prune((uint64_t)time(NULL));
 
-    return true;
+        bool stale = atomic_exchange(&session_manager.snapshot_stale, false);
+        if(stale || now >= session_manager.snapshot_s) {
+            session_snapshot_save();
+            session_manager.snapshot_s = now + SESSION_SNAPSHOT_PERIOD;
+        }
+
+        epoch_reclaim();
+    }
+    printf("\nSession task is out....\n");
+    return NULL;
 }
 
-session_t http_session_login_user(const char* name, const char *password) {
-    size_t user_ref;
-    if((user_ref = user_get(name,true)) == INVALID_USER_ID || strcmp(user_manager.users[user_ref].password, password) != 0)
-        return INVALID_SESSION_ID;
-    
-    rwlock_write_lock(&session_manager.lock);
-    size_t entry;
-    if(session_manager.entries < session_manager.capacity) {
-        for(entry = 0; entry < session_manager.last; ++entry) {
-            if(session_manager.sessions[entry].user_ref == INVALID_USER_ID) break;
+/*private:*/ void user_commit_release(user_commit_t* commit) {
+    if(atomic_fetch_sub(&commit->refs, 1) != 1) return;
+    if(commit->fd >= 0) close(commit->fd);
+    free(commit);
+}
+
+// Syncs the mapped pages holding [start, end) of the map
+/*private:*/ bool user_sync(uint8_t* map, size_t start, size_t end) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    start -= start % page;
+    return (msync(map + start, end - start, MS_SYNC) == 0);
+}
+
+// Makes the users logged so far durable in the store and the index, then empties the WAL.
+// A crash in between is harmless, the replay skips the records the store count already covers
+/*private:*/ void user_wal_checkpoint(size_t committed) {
+    epoch_enter();
+    if(committed > user_manager.checkpointed) {
+        users_table_t* table = atomic_load(&user_manager.table);
+        user_store_header_t* header = user_store_header(table);
+        bool synced = user_sync(table->map, USER_STORE_HEADER + sizeof(user_t) * user_manager.checkpointed,
+            USER_STORE_HEADER + sizeof(user_t) * committed);
+        if(synced) {
+            header->count = committed;
+            synced = user_sync(table->map, 0, sizeof(*header));
+        }
+        if(!synced) {
+            epoch_exit();
+            printf("\nERROR in user_wal_checkpoint: users.store sync failed, keeping the WAL\n");
+            return;
         }
+        user_manager.checkpointed = committed;
     }
-    else {
-        entry = session_manager.last;
-        // Expand the sessions array
-        session_manager.capacity *= 2;
-        session_manager.sessions = (http_session_t*)realloc(session_manager.sessions, sizeof(http_session_t) * session_manager.capacity);
-        memset(&session_manager.sessions[session_manager.last], 0, sizeof(http_session_t) * (session_manager.capacity - session_manager.last));
-        for(size_t i = session_manager.last; i < session_manager.capacity; ++i) {
-            session_manager.sessions[i].user_ref = INVALID_USER_ID;
+    // The index only has to be complete up to its count, the users after it are put again when starting
+    users_index_t* index = atomic_load(&user_manager.index);
+    user_index_header_t* index_header = user_index_header(index);
+    if(index_header->count < user_manager.checkpointed && user_sync(index->map, 0, index->map_size)) {
+        index_header->count = user_manager.checkpointed;
+        (void)user_sync(index->map, 0, sizeof(*index_header));
+    }
+    epoch_exit();
+    if(ftruncate(user_manager.wal_fd, 0) == 0) user_manager.wal_records = 0;
+}
+
+// Group commit: whatever queued up while the previous batch was being synced goes in the next write
+/*private:*/ void* user_wal_writer(void* arg) {
+    user_commit_t* stop = &user_manager.wal_stop;
+    user_commit_t* batch[USER_WAL_BATCH];
+    user_wal_record_t* records = calloc(USER_WAL_BATCH, sizeof(user_wal_record_t));
+    size_t committed = user_manager.checkpointed;
+    bool running = true;
+    while(running) {
+        size_t count = pop_many(user_manager.work, (void**)batch, USER_WAL_BATCH);
+        size_t records_count = 0;
+        epoch_enter();
+        users_table_t* table = atomic_load(&user_manager.table);
+        for(size_t i = 0; i < count; ++i) {
+            if(batch[i] == stop) {
+                running = false;
+                continue;
+            }
+            user_wal_record_t* record = &records[records_count++];
+            record->magic = USER_WAL_MAGIC;
+            record->entry = batch[i]->entry;
+            memcpy(&record->user, &table->users[batch[i]->entry], sizeof(user_t));
+            record->checksum = user_wal_checksum(record);
+        }
+        epoch_exit();
+
+        if(records_count > 0) {
+            if(!user_write_all(user_manager.wal_fd, records, sizeof(user_wal_record_t) * records_count, -1) ||
+                fdatasync(user_manager.wal_fd) != 0) {
+                printf("\nERROR in user_wal_writer: WAL write failed\n");
+            }
+            committed = records[records_count - 1].entry + 1;
+            user_manager.wal_records += records_count;
+        }
+        for(size_t i = 0; i < count; ++i) {
+            if(batch[i] == stop) continue;
+            if(batch[i]->fd >= 0) eventfd_write(batch[i]->fd, 1);
+            user_commit_release(batch[i]);
         }
+        if(user_manager.wal_records >= USER_WAL_CHECKPOINT) user_wal_checkpoint(committed);
     }
+    user_wal_checkpoint(committed);
+    free(records);
+    return NULL;
+}
 
-    http_session_t* session = &session_manager.sessions[entry];
-    if(entry == session_manager.last) session_manager.last += 1;
-    session_manager.entries += 1;
-    session->user_ref = user_ref;
-    session->expire_s = session_manager.session_timeout;
-    rwlock_unlock(&session_manager.lock);
+// Applies the records following the users already in users.store. Replay stops at the first torn or corrupted record,
+// the tail left by a crash, and at a gap since nothing after one can be trusted
+/*private:*/ users_table_t* user_wal_replay(users_table_t* table) {
+    user_wal_record_t record;
+    off_t offset = 0;
+    while(pread(user_manager.wal_fd, &record, sizeof(record), offset) == sizeof(record)) {
+        if(record.magic != USER_WAL_MAGIC || record.checksum != user_wal_checksum(&record)) break;
+        if(record.entry > user_manager.entries) break;
+        if(record.entry == user_manager.entries) {
+            if(user_manager.entries == table->capacity) {
+                users_table_t* new_table = users_table_map(user_manager.store_fd, table->capacity * 2);
+                if(new_table == NULL) break;
+                users_table_release(table);
+                table = new_table;
+            }
+            memcpy(&table->users[user_manager.entries++], &record.user, sizeof(user_t));
+        }
+        offset += sizeof(record);
+    }
+    if(ftruncate(user_manager.wal_fd, offset) != 0) {
+        printf("\nERROR in user_wal_replay: could not drop the WAL tail\n");
+    }
+    user_manager.wal_records = (size_t)offset / sizeof(record);
+    return table;
+}
+
+// Called in an epoch or with the user lock held
+/* private: */ size_t user_get(const char* name) {
+    users_index_t* index = atomic_load(&user_manager.index);
+    for(size_t i = user_hash(name) & index->mask; ; i = (i + 1) & index->mask) {
+        size_t slot = atomic_load_explicit(&index->slots[i], memory_order_acquire);
+        if(slot == USER_INDEX_EMPTY) return INVALID_USER_ID;
+        if(slot > atomic_load(&user_manager.last)) continue;
+        // Loaded after the slot so the table already holds the entry
+        users_table_t* table = atomic_load(&user_manager.table);
+        if(strcmp(table->users[slot - 1].name, name) == 0) return slot - 1;
+    }
+}
 
+// Sliding expiry, only written when the deadline moves to keep the session line clean
+/*private:*/ void session_renew(http_session_t* session) {
+    size_t expire = atomic_load_explicit(&session_manager.now_s, memory_order_relaxed) + session_manager.session_timeout;
+    if(atomic_load_explicit(&session->expire_s, memory_order_relaxed) < expire) {
+        atomic_store_explicit(&session->expire_s, expire, memory_order_relaxed);
+    }
+}
+
+/* private: */ session_t http_session_get_by_id(const session_id_t id, /*out*/size_t* generation) {
     uuid_t binuuid;
-    uuid_generate_random(binuuid);
-    uuid_unparse_lower(binuuid, session->id);
+    if(uuid_parse(id, binuuid) != 0) return INVALID_SESSION_ID;
+    sessions_shard_t* shard = session_shard_of(binuuid);
+    epoch_enter();
+    size_t entry = session_index_find(shard, binuuid);
+    if(entry != INVALID_SESSION_ID) {
+        http_session_t* session = atomic_load(&atomic_load(&shard->table)->slots[entry]);
+        *generation = session->generation;
+        session_renew(session);
+    }
+    epoch_exit();
+    return ((entry == INVALID_SESSION_ID) ? INVALID_SESSION_ID : session_make(shard, entry));
+}
+
+_Static_assert(sizeof(session_id_t) <= sizeof(((http_con_cache_t*)0)->key), "session ids must fit the connection cache");
+
+// Reuses the session the connection resolved for the same cookie, as long as its entry still holds that session
+/*private:*/ session_t session_cache_get(http_con_cache_t* cache, const session_id_t id) {
+    if(cache == NULL || cache->value == INVALID_SESSION_ID || memcmp(cache->key, id, sizeof(session_id_t)) != 0) {
+        return INVALID_SESSION_ID;
+    }
+    epoch_enter();
+    http_session_t* session = session_lookup(cache->value);
+    // A removed session leaves the entry empty, a new session taken the entry since has another generation
+    bool valid = (session != NULL && session->generation == cache->generation);
+    if(valid) session_renew(session);
+    epoch_exit();
+    return (valid ? cache->value : INVALID_SESSION_ID);
+}
+
+bool http_session_register_user(const char* name, const char *password) {
+    // Names are stored terminated in a fixed record, longer ones are refused instead of cut
+    if(strlen(name) >= sizeof(((user_t*)0)->name)) return false;
+
+    // Hashing is slow, fail early for the names already taken
+    epoch_enter();
+    bool taken = (user_get(name) != INVALID_USER_ID);
+    epoch_exit();
+    if(taken) return false;
+
+    user_kdf_job_t* job = calloc(1, sizeof(user_kdf_job_t));
+    if(job == NULL) return false;
+    job->verify = false;
+    strncpy(job->password, password, sizeof(job->password) - 1);
+    bool hashed = user_kdf_run(job);
+    hashed = (hashed && job->result);
+    char stored[sizeof(job->stored)];
+    if(hashed) memcpy(stored, job->stored, sizeof(stored));
+    user_kdf_release(job);
+    if(!hashed) return false;
+
+    user_commit_t* commit = malloc(sizeof(user_commit_t));
+    atomic_init(&commit->refs, 2);
+    commit->fd = eventfd(0, EFD_CLOEXEC);
 
-    rwlock_write_lock(&user_manager.lock);
-    user_manager.users[user_ref].refs += 1;
-    rwlock_unlock(&user_manager.lock);
+    // Note: we have to lock it here to ensure that a parallel request does not register the same user name
+    //       and we will have to keep it locked until the users[] is updated for the same reason
+    //       to free the lock as soon as possible the write back to the file db will be done by the WAL writer
+    lock(&user_manager.lock);
+    if(user_get(name) != INVALID_USER_ID) {
+        unlock(&user_manager.lock);
+        atomic_store(&commit->refs, 1);
+        user_commit_release(commit);
+        return false;
+    }
+
+    size_t entry = atomic_load(&user_manager.last);
+    users_table_t* table = atomic_load(&user_manager.table);
+    if(entry == table->capacity) {
+        // Extend the store, readers keep using the old mapping until they leave their epoch
+        users_table_t* new_table = users_table_map(user_manager.store_fd, table->capacity * 2);
+        if(new_table == NULL) {
+            unlock(&user_manager.lock);
+            atomic_store(&commit->refs, 1);
+            user_commit_release(commit);
+            return false;
+        }
+        atomic_store(&user_manager.table, new_table);
+        epoch_retire(table, users_table_release);
+        table = new_table;
+    }
+
+    user_t* user = &table->users[entry];
+    strncpy(user->name, name, sizeof(user->name) - 1);
+    user->name[sizeof(user->name) - 1] = 0;
+    memcpy(user->password, stored, sizeof(user->password));
+    user_manager.entries += 1;
+    // Readers only look at the user once it is complete
+    atomic_store(&user_manager.last, entry + 1);
+    users_index_t* index = atomic_load(&user_manager.index);
+    if((entry + 1) * 4 > (index->mask + 1) * 3) user_index_rebuild(table, entry + 1);
+    else user_index_put(index, user->name, entry);
+    // Pushed with the lock held so the WAL gets the users in order
+    commit->entry = entry;
+    push(user_manager.work, commit);
+    unlock(&user_manager.lock);
+
+    // The user can already log in, we only wait for it to be durable. An interrupted task leaves it to the writer
+    if(commit->fd >= 0) (void)user_wait(commit->fd);
+    user_commit_release(commit);
+
+    return true;
+}
 
-    return (session_t)entry;
+session_t http_session_login_user(const char* name, const char *password) {
+    user_kdf_job_t* job = calloc(1, sizeof(user_kdf_job_t));
+    if(job == NULL) return INVALID_SESSION_ID;
+    job->verify = true;
+    strncpy(job->password, password, sizeof(job->password) - 1);
+    epoch_enter();
+    size_t user_ref = user_get(name);
+    if(user_ref != INVALID_USER_ID) memcpy(job->stored, atomic_load(&user_manager.table)->users[user_ref].password, sizeof(job->stored));
+    epoch_exit();
+    if(user_ref == INVALID_USER_ID) {
+        OPENSSL_cleanse(job, sizeof(*job));
+        free(job);
+        return INVALID_SESSION_ID;
+    }
+    bool valid = user_kdf_run(job);
+    valid = (valid && job->result);
+    user_kdf_release(job);
+    if(!valid) return INVALID_SESSION_ID;
+    // Stateless sessions are only the user, the token is created with the cookie
+    if(session_manager.stateless) return (session_t)user_ref;
+
+    // The session is complete before it is published
+    http_session_t* session = malloc(sizeof(http_session_t));
+    session->user_ref = user_ref;
+    atomic_init(&session->expire_s, atomic_load(&session_manager.now_s) + session_manager.session_timeout);
+    uuid_generate_random(session->id);
+
+    return session_publish(session);
 }
 
 session_t http_session_get(http_request_t* request) {
@@ -231,46 +1342,92 @@ session_t http_session_get(http_request_t* request) {
 
     // If there is no session id on the request we can't identify the session
     if(rcv_id == NULL) return INVALID_SESSION_ID;
-    
+
+    if(session_manager.stateless) {
+        session_token_t token;
+        if(!session_token_parse(rcv_id, &token) || session_token_revoked(&token)) return INVALID_SESSION_ID;
+        return (session_t)token.user_ref;
+    }
+
     memcpy(id, rcv_id, sizeof(id) - 1);
     id[36] = 0;
 
-    return http_session_get_by_id(id);
+    session_t session = session_cache_get(request->cache, id);
+    if(session != INVALID_SESSION_ID) return session;
+
+    size_t generation;
+    session = http_session_get_by_id(id, &generation);
+    if(request->cache != NULL) {
+        memcpy(request->cache->key, id, sizeof(id));
+        request->cache->value = session;
+        request->cache->generation = generation;
+    }
+    return session;
 }
 
 void http_session_logout_user(http_request_t* request) {
     // Try to get current session
-    session_t entry = http_session_get(request);
+    session_t current = http_session_get(request);
     // If entry is invalid we fuck up xD
-    if(entry == INVALID_SESSION_ID) {
+    if(current == INVALID_SESSION_ID) {
         printf("\nERROR in http_session_logout_user: invalid id we fuck up xD\n");
         return;
     }
 
-    rwlock_write_lock(&session_manager.lock);
-    http_session_t* session = &session_manager.sessions[entry];
-    memset(session->id, 0, sizeof(session->id));
+    if(session_manager.stateless) {
+        session_token_t token;
+        session_token_parse(http_get_cookie(request, "session_id"), &token);
+        session_token_revoke(&token);
+        return;
+    }
 
-    rwlock_write_lock(&user_manager.lock);
-    user_manager.users[session->user_ref].refs -= 1;
-    rwlock_unlock(&user_manager.lock);
+    // The entry might have been reused since we looked it up
+    session_id_t id;
+    uuid_t binuuid;
+    memcpy(id, http_get_cookie(request, "session_id"), sizeof(id) - 1);
+    id[36] = 0;
+    uuid_parse(id, binuuid);
 
-    session->user_ref = INVALID_USER_ID;
-    if(entry == (session_manager.last - 1)) session_manager.last -= 1;
-    rwlock_unlock(&session_manager.lock);
+    sessions_shard_t* shard = session_shard(current);
+    size_t entry = session_entry(current);
+    lock(&shard->lock);
+    sessions_table_t* table = atomic_load(&shard->table);
+    http_session_t* session = atomic_load(&table->slots[entry]);
+    if(session != NULL && memcmp(session->id, binuuid, sizeof(uuid_t)) == 0) session_remove(shard, table, entry);
+    unlock(&shard->lock);
+    // A logged out session must not come back with a restart
+    atomic_store(&session_manager.snapshot_stale, true);
 }
 
 bool http_session_get_id(session_t session, /*out*/session_id_t session_id) {
-    // We are trusting the user of this function xD
-    // read lock
-    memcpy(session_id, session_manager.sessions[session].id, sizeof(session_id_t) - 1);
-    // unlock
-    session_id[36] = 0;
-    return true;
+    // Stateless sessions have no id, only tokens
+    if(session_manager.stateless) {
+        session_id[0] = 0;
+        return false;
+    }
+    epoch_enter();
+    http_session_t* entry = session_lookup(session);
+    if(entry != NULL) uuid_unparse_lower(entry->id, session_id);
+    else session_id[0] = 0;
+    epoch_exit();
+    return (entry != NULL);
 }
 
 void http_session_set_cookie(session_t session, http_response_t* response) {
     char cookie_value[256];
+    if(session_manager.stateless) {
+        session_token_t token = {.user_ref = session, .expire_s = (uint64_t)time(NULL) + session_manager.session_timeout};
+        RAND_bytes(token.nonce, sizeof(token.nonce));
+        session_token_sign(&token, token.mac);
+        const uint8_t* raw = (const uint8_t*)&token;
+        for(size_t i = 0; i < sizeof(token); ++i) {
+            sprintf(cookie_value + i * 2, "%02x", raw[i]);
+        }
+        memcpy(cookie_value + SESSION_TOKEN_LEN, "; HttpOnly; Secure; SameSite=Strict", sizeof("; HttpOnly; Secure; SameSite=Strict"));
+        http_set_cookie(response, "session_id", cookie_value);
+        return;
+    }
+
     session_id_t id;
     http_session_get_id(session, id);
     memcpy(cookie_value + sizeof(id), "; HttpOnly; Secure; SameSite=Strict", sizeof("; HttpOnly; Secure; SameSite=Strict"));
@@ -278,77 +1435,261 @@ void http_session_set_cookie(session_t session, http_response_t* response) {
     http_set_cookie(response, "session_id", cookie_value);
 }
 
+/*private:*/ int user_db_open(const char* name, int flags) {
+    char path[256];
+    user_db_path(name, path);
+    return open(path, flags | O_CLOEXEC, 0644);
+}
+
+/*private:*/ void user_store_reserve(users_table_t** table, size_t count) {
+    if(count <= (*table)->capacity) return;
+    size_t capacity = (*table)->capacity;
+    while(capacity < count) capacity *= 2;
+    users_table_release(*table);
+    *table = users_table_map(user_manager.store_fd, capacity);
+    if(*table == NULL) {
+        printf("\nERROR in user_store_reserve: could not extend users.store\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*private:*/ void user_from_v1(user_t* user, const user_v1_t* record) {
+    memcpy(user->name, record->name, sizeof(user->name));
+    memcpy(user->password, record->password, sizeof(user->password));
+}
+
+// Appends up to count version 1 records read from fd at offset, returns the users in the table after them
+/*private:*/ size_t user_store_copy_v1(users_table_t** table, size_t entries, int fd, off_t offset, size_t count) {
+    user_v1_t records[USER_STORE_V1_CHUNK];
+    user_store_reserve(table, entries + count);
+    while(count > 0) {
+        size_t chunk = ((count < USER_STORE_V1_CHUNK) ? count : USER_STORE_V1_CHUNK);
+        ssize_t size = pread(fd, records, sizeof(user_v1_t) * chunk, offset);
+        size_t read = ((size < 0) ? 0 : (size_t)size / sizeof(user_v1_t));
+        for(size_t i = 0; i < read; ++i) user_from_v1(&(*table)->users[entries + i], &records[i]);
+        entries += read;
+        count -= read;
+        offset += (off_t)(sizeof(user_v1_t) * read);
+        if(read < chunk) break;
+    }
+    return entries;
+}
+
+// Same rules as user_wal_replay() for the records written by version 1
+/*private:*/ size_t user_wal_replay_v1(users_table_t** table, size_t entries) {
+    user_wal_record_v1_t record;
+    off_t offset = 0;
+    while(pread(user_manager.wal_fd, &record, sizeof(record), offset) == sizeof(record)) {
+        if(record.magic != USER_WAL_MAGIC) break;
+        if(record.checksum != user_wal_crc(&record.magic, sizeof(record) - offsetof(user_wal_record_v1_t, magic))) break;
+        if(record.entry > entries) break;
+        if(record.entry == entries) {
+            user_store_reserve(table, entries + 1);
+            user_from_v1(&(*table)->users[entries++], &record.user);
+        }
+        offset += sizeof(record);
+    }
+    return entries;
+}
+
+// Moves the users of the previous layouts into the new store: version 1 of users.store with its WAL,
+// or raw records in users.db counted by .meta.bin
+/*private:*/ size_t user_store_migrate(users_table_t** table) {
+    size_t count = 0;
+    int v1_fd = user_db_open("users.store.v1", O_RDONLY);
+    if(v1_fd >= 0) {
+        user_store_header_t header;
+        if(pread(v1_fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == USER_STORE_MAGIC && header.version == 1) {
+            count = user_store_copy_v1(table, 0, v1_fd, USER_STORE_HEADER, header.count);
+            count = user_wal_replay_v1(table, count);
+        }
+        close(v1_fd);
+        if(count > 0) printf("\nMoved %zu users to users.store version %u\n", count, USER_STORE_VERSION);
+        return count;
+    }
+
+    int meta_fd = user_db_open(".meta.bin", O_RDONLY);
+    int db_fd = user_db_open("users.db", O_RDONLY);
+    if(meta_fd >= 0 && db_fd >= 0 && pread(meta_fd, &count, sizeof(count), 0) == sizeof(count) && count > 0) {
+        count = user_store_copy_v1(table, 0, db_fd, 0, count);
+    }
+    if(meta_fd >= 0) close(meta_fd);
+    if(db_fd >= 0) close(db_fd);
+    if(count > 0) printf("\nMoved %zu users to users.store\n", count);
+    return count;
+}
+
+// Called once the moved users are durable, the WAL records of version 1 are in users.store by then
+/*private:*/ void user_store_drop_legacy() {
+    char path[256];
+    user_db_path(".meta.bin", path);
+    unlink(path);
+    user_db_path("users.db", path);
+    unlink(path);
+    user_db_path("users.store.v1", path);
+    if(unlink(path) == 0 && ftruncate(user_manager.wal_fd, 0) != 0) {
+        printf("\nERROR in user_store_drop_legacy: could not empty the WAL\n");
+    }
+}
+
 /*private:*/ void load_user_db(char* server_data, size_t default_capacity) {
     user_manager.server_data = server_data;
-    // Check if .sever foulder exists
-    char temp_path[256];
-    size_t len = strlen(server_data);
-
-    // Check if .server exists (we only check this folder previous ones have to alreayd exist!)
-    DIR* dir = opendir(server_data);
-    if(dir == NULL) {
-        mkdir(server_data, 0777);
-        // Create .server files
-        memcpy(temp_path, server_data, len);
-        memcpy(temp_path + len, ".meta.bin", sizeof(".meta.bin"));
-        user_manager.meta_fp = fopen(temp_path, "w");
-        size_t user_count = 0;
-        fwrite(&user_count, sizeof(size_t), 1, user_manager.meta_fp);
-        user_manager.meta_fp = freopen(temp_path, "r+", user_manager.meta_fp);
-        // Create users.db
-        memcpy(temp_path + len, "users.db", sizeof("users.db"));
-        user_manager.db_fp = fopen(temp_path, "a+");
-
-        user_manager.capacity = default_capacity;
-        user_manager.users = (user_t*)calloc(user_manager.capacity, sizeof(user_t));
+    // Only .server is created, the folders above it have to already exist
+    mkdir(server_data, 0777);
+
+    user_manager.store_fd = user_db_open("users.store", O_RDWR | O_CREAT);
+    user_store_header_t stored;
+    if(pread(user_manager.store_fd, &stored, sizeof(stored), 0) == sizeof(stored) && stored.magic == USER_STORE_MAGIC && stored.version == 1) {
+        // Its records do not fit the current layout, a new store is filled from it
+        char path[256], moved[256];
+        user_db_path("users.store", path);
+        user_db_path("users.store.v1", moved);
+        close(user_manager.store_fd);
+        if(rename(path, moved) != 0) {
+            printf("\nERROR in load_user_db: could not move users.store version 1 aside\n");
+            exit(EXIT_FAILURE);
+        }
+        user_manager.store_fd = user_db_open("users.store", O_RDWR | O_CREAT);
     }
-    else {
-        memcpy(temp_path, server_data, len);
-        memcpy(temp_path + len, ".meta.bin", sizeof(".meta.bin"));
-        user_manager.meta_fp = fopen(temp_path, "r+");
-        
-        fread(&user_manager.entries, sizeof(user_manager.entries), 1, user_manager.meta_fp);
-
-        memcpy(temp_path + len, "users.db", sizeof("users.db"));
-        if(user_manager.entries == 0) {
-            // Just make sure the users_db is clena
-            user_manager.db_fp = fopen(temp_path, "w");
-            user_manager.db_fp = freopen(temp_path, "a+", user_manager.db_fp);
+    user_manager.wal_fd = user_db_open("users.wal", O_RDWR | O_CREAT);
+    // The WAL is only appended to, the checkpoint truncates it
+    fcntl(user_manager.wal_fd, F_SETFL, O_APPEND);
+
+    // Only the header is looked at, the records are paged in when used
+    struct stat st;
+    fstat(user_manager.store_fd, &st);
+    size_t capacity = default_capacity;
+    if((size_t)st.st_size > USER_STORE_HEADER) {
+        size_t records = ((size_t)st.st_size - USER_STORE_HEADER) / sizeof(user_t);
+        if(records > capacity) capacity = records;
+    }
+    users_table_t* table = users_table_map(user_manager.store_fd, capacity);
+    if(table == NULL) {
+        printf("\nERROR in load_user_db: could not map users.store\n");
+        exit(EXIT_FAILURE);
+    }
+    user_store_header_t* header = user_store_header(table);
+    if(header->magic != USER_STORE_MAGIC) {
+        // A new store, filled from the previous layout if there is one
+        *header = (user_store_header_t){USER_STORE_MAGIC, USER_STORE_VERSION, sizeof(user_t), 0, 0};
+        // Moving the users can map the store again, the header is only written through the new mapping
+        size_t count = user_store_migrate(&table);
+        header = user_store_header(table);
+        header->count = count;
+        if(user_sync(table->map, 0, table->map_size)) user_store_drop_legacy();
+    }
+    else if(header->version != USER_STORE_VERSION || header->record_size != sizeof(user_t)) {
+        printf("\nERROR in load_user_db: users.store version %u is not supported\n", header->version);
+        exit(EXIT_FAILURE);
+    }
+    user_manager.entries = header->count;
+    user_manager.checkpointed = header->count;
+
+    table = user_wal_replay(table);
+    atomic_init(&user_manager.table, table);
+    atomic_init(&user_manager.last, user_manager.entries);
+
+    // The index is reused when it covers some users, only the ones after its count are put again
+    atomic_init(&user_manager.index, NULL);
+    user_manager.index_fd = user_db_open("users.index", O_RDWR);
+    users_index_t* index = NULL;
+    if(user_manager.index_fd >= 0 && fstat(user_manager.index_fd, &st) == 0 && (size_t)st.st_size > USER_STORE_HEADER) {
+        index = users_index_map(user_manager.index_fd, ((size_t)st.st_size - USER_STORE_HEADER) / sizeof(size_t));
+        user_index_header_t* index_header = ((index == NULL) ? NULL : user_index_header(index));
+        if(index_header != NULL && (index_header->magic != USER_INDEX_MAGIC || index_header->version != USER_STORE_VERSION ||
+            index_header->mask != index->mask || index_header->count > user_manager.entries)) {
+            users_index_release(index);
+            index = NULL;
         }
-        else {
-            user_manager.db_fp = fopen(temp_path, "a+");
+    }
+    if(index == NULL) {
+        if(user_manager.index_fd >= 0) close(user_manager.index_fd);
+        user_index_rebuild(table, user_manager.entries);
+    }
+    else {
+        atomic_init(&user_manager.index, index);
+        for(size_t entry = user_index_header(index)->count; entry < user_manager.entries; ++entry) {
+            user_index_put(index, table->users[entry].name, entry);
         }
+        if((user_manager.entries + 1) * 4 > (index->mask + 1) * 3) user_index_rebuild(table, user_manager.entries);
+    }
 
-        user_manager.last = user_manager.entries;
-        user_manager.capacity = user_manager.entries + default_capacity;
-        user_manager.users = (user_t*)calloc(user_manager.capacity, sizeof(user_t));
+    // Fold what was replayed right away so the WAL starts empty and the index counts every user
+    user_wal_checkpoint(user_manager.entries);
+}
 
-        fread(user_manager.users, sizeof(user_t), user_manager.entries, user_manager.db_fp);
-    }
-    closedir(dir);
+void http_session_set_kdf(http_session_kdf_t kdf, unsigned cost, size_t threads) {
+    if(session_manager.running) return;
+    user_manager.kdf = kdf;
+    user_manager.kdf_cost = cost;
+    user_manager.kdf_threads = threads;
+}
+
+void http_session_set_stateless(bool stateless) {
+    if(!session_manager.running) session_manager.stateless = stateless;
 }
 
 int http_session_engine_start(size_t base_capacity, char* server_data, size_t session_timeout_s) {
     if(session_manager.running) return -1;
 
-    session_manager.capacity = ((base_capacity == 0) ? SESSIONS_DEFAULT_CAPACITY : base_capacity);
-    session_manager.sessions = (http_session_t*)calloc(session_manager.capacity, sizeof(http_session_t));
-
-    for(size_t i = 0; i < session_manager.capacity; ++i) {
-        session_manager.sessions[i].user_ref = INVALID_USER_ID;
+    size_t capacity = ((base_capacity == 0) ? SESSIONS_DEFAULT_CAPACITY : base_capacity);
+    // The base capacity is spread over the shards, each one grows on its own
+    size_t shard_capacity = (capacity + SESSION_SHARDS - 1) / SESSION_SHARDS;
+    for(size_t s = 0; s < SESSION_SHARDS; ++s) {
+        sessions_shard_t* shard = &session_manager.shards[s];
+        atomic_init(&shard->table, sessions_table_create(shard_capacity));
+        shard->free = malloc(sizeof(size_t) * shard_capacity);
+        shard->heap = malloc(sizeof(http_session_t*) * shard_capacity);
+        shard->heap_count = 0;
+        shard->free_count = 0;
+        for(size_t i = shard_capacity; i > 0; --i) {
+            shard->free[shard->free_count++] = i - 1;
+        }
+        shard->entries = 0;
+        shard->index_used = 0;
+        atomic_init(&shard->index, NULL);
+        session_index_rebuild(shard, atomic_load(&shard->table));
+        lock_init(&shard->lock);
     }
 
     // Also start the users manager TODO: in future decouple the user from the session
-    load_user_db(server_data, session_manager.capacity);
+    load_user_db(server_data, capacity);
 
-    rwlock_init(&session_manager.lock);
-    rwlock_init(&user_manager.lock);
+    lock_init(&user_manager.lock);
 
-    user_manager.work = queue_create(session_manager.capacity * 2);
+    user_manager.work = queue_create(USER_WAL_QUEUE);
+    pthread_create(&user_manager.wal_writer, NULL, user_wal_writer, NULL);
+
+    if(user_manager.kdf_cost == 0) {
+        user_manager.kdf_cost = ((user_manager.kdf == HTTP_SESSION_KDF_SCRYPT) ? USER_KDF_SCRYPT_COST : USER_KDF_PBKDF2_COST);
+    }
+    user_manager.kdf_pool = threadPool_create(USER_KDF_QUEUE, ((user_manager.kdf_threads == 0) ? 1 : user_manager.kdf_threads));
+    threadPool_dispach(user_manager.kdf_pool);
+    lock_init(&user_manager.kdf_lock);
+    signal_init(&user_manager.kdf_idle);
+    user_manager.kdf_pending = 0;
+    user_manager.kdf_open = true;
+    user_manager.kdf_parked = NULL;
+    user_manager.kdf_parked_tail = NULL;
+
+    lock_init(&session_manager.revoked.lock);
+    atomic_init(&session_manager.revoked.count, 0);
+    session_manager.revoked.capacity = SESSION_REVOKED_MIN;
+    session_manager.revoked.entries = malloc(sizeof(session_revoked_t) * SESSION_REVOKED_MIN);
+    if(session_manager.stateless && session_key_load(server_data) != 0) {
+        printf("\nSession key could not be loaded, using stateful sessions\n");
+        session_manager.stateless = false;
+    }
 
     session_manager.session_timeout = (session_timeout_s == 0) ? SESSION_DEFAULT_TIMEOUT : session_timeout_s;
+    atomic_init(&session_manager.now_s, session_clock_s());
+    atomic_init(&session_manager.generation, 0);
+    session_snapshot_load();
+    session_manager.snapshot_s = atomic_load(&session_manager.now_s) + SESSION_SNAPSHOT_PERIOD;
+    atomic_init(&session_manager.snapshot_stale, false);
     session_manager.running = true;
-    session_manager.worker = async(session_task, (void*)user_manager.entries);
+    session_manager.timer = async_timer_create(1000);
+    session_manager.worker = async_priority(AsyncPriorityBackground, session_task, NULL);
 
     return 0;
 }
@@ -356,26 +1697,66 @@ int http_session_engine_start(size_t base_capacity, char* server_data, size_t se
 void http_session_engine_stop() {
     // Signal the session timeout task to terminate
     session_manager.running = false;
+    async_timer_stop(session_manager.timer);
 
     await(&session_manager.worker);
+    async_timer_destroy(&session_manager.timer);
+    session_snapshot_save();
+
+    // Refuse new hashing and let the queued and running jobs finish, their callers still wait for them
+    lock(&user_manager.kdf_lock);
+    user_manager.kdf_open = false;
+    while(user_manager.kdf_pending > 0) lock_wait(&user_manager.kdf_lock, &user_manager.kdf_idle);
+    unlock(&user_manager.kdf_lock);
+    threadPool_destroy(&user_manager.kdf_pool, false);
 
+    // The writer logs everything queued before the stop mark and checkpoints
+    push(user_manager.work, &user_manager.wal_stop);
+    pthread_join(user_manager.wal_writer, NULL);
     queue_destroy(&user_manager.work);
 
-    fclose(user_manager.db_fp);
-    fclose(user_manager.meta_fp);
+    close(user_manager.wal_fd);
 
     free(user_manager.server_data);
-    free(user_manager.users);
-    free(session_manager.sessions);
+    for(size_t s = 0; s < SESSION_SHARDS; ++s) {
+        sessions_shard_t* shard = &session_manager.shards[s];
+        sessions_table_t* table = atomic_load(&shard->table);
+        for(size_t i = 0; i < table->capacity; ++i) {
+            free(atomic_load(&table->slots[i]));
+        }
+        free(table);
+        free(atomic_load(&shard->index));
+        free(shard->free);
+        free(shard->heap);
+    }
+    users_table_release(atomic_load(&user_manager.table));
+    users_index_release(atomic_load(&user_manager.index));
+    close(user_manager.store_fd);
+    close(user_manager.index_fd);
+    // Tables and sessions replaced while running
+    epoch_flush();
 
-    rwlock_destroy(&session_manager.lock);
-    rwlock_destroy(&user_manager.lock);
+    for(size_t s = 0; s < SESSION_SHARDS; ++s) {
+        lock_destroy(&session_manager.shards[s].lock);
+    }
+    free(session_manager.revoked.entries);
+    lock_destroy(&session_manager.revoked.lock);
+    OPENSSL_cleanse(session_manager.key, SESSION_KEY_SIZE);
+    lock_destroy(&user_manager.lock);
+    lock_destroy(&user_manager.kdf_lock);
+    signal_destroy(&user_manager.kdf_idle);
 }
 
 void http_session_get_username(session_t session, /*out*/char* username) {
-    rwlock_write_lock(&session_manager.lock);
-    rwlock_write_lock(&user_manager.lock);
-    strcpy(username, user_manager.users[session_manager.sessions[session].user_ref].name);
-    rwlock_unlock(&user_manager.lock);
-    rwlock_unlock(&session_manager.lock);
+    epoch_enter();
+    if(session_manager.stateless) {
+        if(session < atomic_load(&user_manager.last)) strcpy(username, atomic_load(&user_manager.table)->users[session].name);
+        else username[0] = 0;
+        epoch_exit();
+        return;
+    }
+    http_session_t* entry = session_lookup(session);
+    if(entry != NULL) strcpy(username, atomic_load(&user_manager.table)->users[entry->user_ref].name);
+    else username[0] = 0;
+    epoch_exit();
 }
\ No newline at end of file
@@ -19,6 +19,7 @@ typedef size_t session_t;
 
 /*
  * Try to create a new user, if success return true otherwise false
+ * Names of 126 characters or more are refused
 */
 bool http_session_register_user(const char* name, const char *password);
 
@@ -50,8 +51,29 @@ bool http_session_get_id(session_t session, /*out*/session_id_t session_id);
 */
 void http_session_set_cookie(session_t session, http_response_t* response);
 
+// Key derivation used for new passwords, the stored hashes remember theirs so changing it keeps old users valid
+typedef enum {
+    HTTP_SESSION_KDF_PBKDF2 = 0,    // PBKDF2-HMAC-SHA256, cost is the iteration count
+    HTTP_SESSION_KDF_SCRYPT         // scrypt with r = 8 and p = 1, cost is log2 of N
+}http_session_kdf_t;
+
+/*
+ * Selects the password key derivation, only takes effect before the engine starts
+ * A zero cost keeps the default of the kdf. Hashing runs on its own pool of threads (1 when 0), the calling task is
+ * suspended meanwhile so login spikes do not hold the request workers
+*/
+void http_session_set_kdf(http_session_kdf_t kdf, unsigned cost, size_t threads);
+
+/*
+ * Switches to stateless sessions, only takes effect before the engine starts
+ * The cookie then holds an HMAC signed token with the user and its expiry that is checked without any session lookup,
+ * the signing key is kept in server_data so tokens survive restarts. Logout revokes the token until it expires
+*/
+void http_session_set_stateless(bool stateless);
+
 /*
  * Starts the session manager engine
+ * Sessions still alive in the last snapshot of server_data are restored with their expiry
  * Returns 0 in case of success
 */
 int http_session_engine_start(size_t base_capacity, char* server_data, size_t session_timeout_s);
@@ -1,9 +1,22 @@
+#define _GNU_SOURCE
 #include <ucontext.h>
 #include <async.h>
 #include <lock.h>
 #include <threadpool.h>
+#include <reactor.h>
+#include <stdio.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define ASYNC_MAX_NODES     8
+#define ASYNC_WAKE_BATCH    64
+#define ASYNC_NODE_PATH     "/sys/devices/system/node/node%d/cpu%d"
 
 struct asyncTask_t {
     void* (*func)(asyncTask_t*, void*);
@@ -12,62 +25,180 @@ struct asyncTask_t {
     void* ret;
     lock_t lock;
     signal_t signal;
+    asyncPriority_t priority;
+    unsigned node;
+    asyncGroup_t* group;
+    size_t index;
     volatile asyncState_t state;
+    // Checked at suspend points, the deadline is zero when there is none
+    asyncCancel_t* cancel;
+    uint64_t deadline_ms;
+    // How to end the current await or sleep early, guarded by the task lock
+    struct asyncAbort_t* abort;
 };
 
+_Static_assert(AsyncPriorities <= THREADPOOL_PRIORITIES, "Every async priority needs a thread pool class");
+
 const size_t DEFAULT_STACK_CAPACITY = 4096 * 16;    // Going lower seems to fail when trying to grow the stack
 
+// Free stacks are cached per NUMA node so a task always gets memory local to the thread running it
+typedef struct asyncStacks_t {
+    lock_t lock;
+    size_t count;
+    size_t capacity;
+    void** sps;
+} asyncStacks_t;
+
 static struct {
     bool running;
     threadPool_t* threads;
+    reactor_t* reactor;
+    int* cpus;
+    size_t cpus_count;
+    // Elastic sizing, see async_engine_elastic()
+    bool elastic;
+    size_t min_threads;
+    size_t max_threads;
+    int latency_ms;
+    int idle_ms;
+    asyncStacks_t stacks[ASYNC_MAX_NODES];
+} async_ctrl = {.running = false, .threads = NULL, .reactor = NULL, .cpus = NULL, .cpus_count = 0};
+
+// Work left by a task for the thread it switches back to. It is only executed once the task
+// context is saved, that way the task can be resumed right away by any other thread
+typedef struct asyncSwitch_t {
+    void (*park)(asyncTask_t*, void*);
+    void* arg;
+} asyncSwitch_t;
+
+// Lets async_cancel() end a suspended task early by moving its timer to now, the timer callback
+// runs in the reactor thread which is the only one allowed to drop the pending watch
+typedef struct asyncAbort_t {
+    reactor_timer_t* timer;
+    reactor_timer_cb_t expired;
+    void* arg;
+    bool armed;
+} asyncAbort_t;
+
+typedef struct asyncIo_t {
+    reactor_watch_t watch;
+    asyncTask_t* task;
+    int fd;
+    uint32_t events;
+    uint32_t revents;
+    EAsync_t status;
+    bool abortable;
+    bool watching;
+    reactor_timer_t timer;
+    asyncAbort_t abort;
+} asyncIo_t;
+
+typedef struct asyncSleep_t {
+    reactor_timer_t timer;
+    asyncTask_t* task;
+    asyncTimer_t* periodic;
+    uint64_t deadline_ms;
+    bool abortable;
+    asyncAbort_t abort;
+} asyncSleep_t;
+
+struct asyncCancel_t {
     lock_t lock;
-    size_t stacks_entries;
-    void** sps;
-} async_ctrl = {false, NULL, LOCK_INITIALIZER, 0, NULL};
-
-static void* async_get_stack() {
-    lock(&async_ctrl.lock);
-    void* sp = NULL;
-    for(size_t i = 0; i < async_ctrl.stacks_entries; ++i) {
-        if(async_ctrl.sps[i] != NULL) {
-            sp = async_ctrl.sps[i];
-            async_ctrl.sps[i] = NULL;
-            break;
-        }
-    }
-    if(sp == NULL) {
-        size_t new_entry = async_ctrl.stacks_entries;
-        async_ctrl.stacks_entries *= 2;
-        async_ctrl.sps = realloc(async_ctrl.sps, sizeof(void*) * async_ctrl.stacks_entries);
-        for(size_t i = new_entry + 1; i < async_ctrl.stacks_entries; ++i)
-            async_ctrl.sps[i] = mmap(NULL, DEFAULT_STACK_CAPACITY, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_STACK|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0);
-        async_ctrl.sps[new_entry] = NULL;
-        sp = mmap(NULL, DEFAULT_STACK_CAPACITY, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_STACK|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0);
+    atomic_bool cancelled;
+    size_t refs;
+    // Task to wake when cancelled, cleared once it finishes
+    asyncTask_t* task;
+};
+
+struct asyncGroup_t {
+    lock_t lock;
+    signal_t signal;
+    asyncTask_t* parent;
+    asyncTask_t* waiter;
+    volatile bool cancelled;
+    size_t count;
+    size_t done;
+    size_t target;
+    ssize_t first;
+    size_t capacity;
+    void** results;
+};
+
+struct asyncTimer_t {
+    lock_t lock;
+    bool stopped;
+    uint64_t period_ms;
+    uint64_t next_ms;
+    asyncSleep_t* pending;
+};
+
+// Tasks woken by reactor callbacks, only used by the reactor thread and dispatched once per wakeup.
+// The ones the pool has no room for stay here until a later wakeup, the reactor never blocks on the pool
+static struct {
+    size_t count[AsyncPriorities];
+    size_t capacity[AsyncPriorities];
+    asyncTask_t** tasks[AsyncPriorities];
+} async_woken;
+
+static __thread asyncSwitch_t async_switch;
+static __thread asyncTask_t* async_current;
+
+static unsigned async_current_node() {
+    unsigned cpu = 0, node = 0;
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+    return (node % ASYNC_MAX_NODES);
+}
+
+static unsigned async_cpu_node(int cpu) {
+    char path[64];
+    for(int node = 0; node < ASYNC_MAX_NODES; ++node) {
+        snprintf(path, sizeof(path), ASYNC_NODE_PATH, node, cpu);
+        if(access(path, F_OK) == 0) return node;
     }
-    unlock(&async_ctrl.lock);
+    return 0;
+}
 
+static void* async_new_stack(unsigned node) {
+    void* sp = mmap(NULL, DEFAULT_STACK_CAPACITY, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_STACK|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0);
+    if(sp == MAP_FAILED) return NULL;
+    if(async_ctrl.cpus_count > 0) {
+        // Pages are not touched yet so we can still ask for them to come from the local node
+        unsigned long mask = (1UL << node);
+        (void)syscall(SYS_mbind, sp, DEFAULT_STACK_CAPACITY, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
     return sp;
 }
 
-static void async_free_stack(void* sp) {
-    lock(&async_ctrl.lock);
-    for(size_t i = 0; i < async_ctrl.stacks_entries; ++i) {
-        if(async_ctrl.sps[i] == NULL) {
-            async_ctrl.sps[i] = sp;
-            break;
-        }
+static void* async_get_stack(unsigned node) {
+    asyncStacks_t* stacks = &async_ctrl.stacks[node];
+    lock(&stacks->lock);
+    void* sp = ((stacks->count > 0) ? stacks->sps[--stacks->count] : NULL);
+    unlock(&stacks->lock);
+
+    return ((sp != NULL) ? sp : async_new_stack(node));
+}
+
+static void async_free_stack(void* sp, unsigned node) {
+    asyncStacks_t* stacks = &async_ctrl.stacks[node];
+    lock(&stacks->lock);
+    if(stacks->count == stacks->capacity) {
+        stacks->capacity = ((stacks->capacity > 0) ? stacks->capacity * 2 : 2);
+        stacks->sps = realloc(stacks->sps, sizeof(void*) * stacks->capacity);
     }
-    unlock(&async_ctrl.lock);
+    stacks->sps[stacks->count++] = sp;
+    unlock(&stacks->lock);
 }
 
-void async_set_state(asyncTask_t* task, asyncState_t state) {
-    if(state == AsyncRunning){
-        task->state = AsyncRunning;
-        return;
+static void async_release_stacks() {
+    for(size_t node = 0; node < ASYNC_MAX_NODES; ++node) {
+        asyncStacks_t* stacks = &async_ctrl.stacks[node];
+        for(size_t i = 0; i < stacks->count; ++i) {
+            munmap(stacks->sps[i], DEFAULT_STACK_CAPACITY);
+        }
+        free(stacks->sps);
+        lock_destroy(&stacks->lock);
+        memset(stacks, 0, sizeof(*stacks));
     }
-    lock(&task->lock);
-    if(task->state != AsyncDetached) task->state = state;
-    unlock_signal(&task->lock, &task->signal);
 }
 
 static asyncState_t async_wait_suspend(asyncTask_t* task, int wait_ms) {
@@ -82,57 +213,448 @@ static asyncState_t async_wait_suspend(asyncTask_t* task, int wait_ms) {
 }
 
 static void asyncTask_clean(asyncTask_t** task) {
-    async_free_stack((*task)->callee_ctx.uc_stack.ss_sp);
+    async_free_stack((*task)->callee_ctx.uc_stack.ss_sp, (*task)->node);
     lock_destroy(&(*task)->lock);
     signal_destroy(&(*task)->signal);
     free(*task);
     *task = NULL;
 }
 
+static void async_cancel_unbind(asyncTask_t* task) {
+    asyncCancel_t* token = task->cancel;
+    if(token == NULL) return;
+    task->cancel = NULL;
+    lock(&token->lock);
+    // The token might already be bound to the next task
+    if(token->task == task) token->task = NULL;
+    unlock(&token->lock);
+    async_cancel_release(&token);
+}
+
+// Releases a task that was never dispatched, it does not own a stack yet
+static void asyncTask_clean_unborn(asyncTask_t** task) {
+    async_cancel_unbind(*task);
+    lock_destroy(&(*task)->lock);
+    signal_destroy(&(*task)->signal);
+    free(*task);
+    *task = NULL;
+}
+
+// A task can be resumed by a different thread so the thread local is only accessed
+// from functions that are not inlined, preventing the compiler from caching its address
+static __attribute__((noinline)) void async_switch_set(void (*park)(asyncTask_t*, void*), void* arg) {
+    async_switch.park = park;
+    async_switch.arg = arg;
+}
+
+static __attribute__((noinline)) asyncSwitch_t async_switch_take() {
+    asyncSwitch_t sw = async_switch;
+    memset(&async_switch, 0, sizeof(async_switch));
+    return sw;
+}
+
+static __attribute__((noinline)) asyncTask_t* async_current_swap(asyncTask_t* task) {
+    asyncTask_t* prev = async_current;
+    async_current = task;
+    return prev;
+}
+
+static void async_switched(asyncTask_t* task) {
+    asyncSwitch_t sw = async_switch_take();
+    if(sw.park != NULL) sw.park(task, sw.arg);
+}
+
+static void async_park(asyncTask_t* task, void (*park)(asyncTask_t*, void*), void* arg) {
+    async_switch_set(park, arg);
+    swapcontext(&task->callee_ctx, &task->caller_ctx);
+}
+
+static void async_resume(asyncTask_t* task) {
+    asyncTask_t* prev = async_current_swap(task);
+    swapcontext(&task->caller_ctx, &task->callee_ctx);
+    async_current_swap(prev);
+    async_switched(task);
+}
+
+static void async_wake(asyncTask_t* task) {
+    threadPool_pushWorkPriority(async_ctrl.threads, task->priority, (void* (*)(void*))async_resume, task);
+}
+
+static bool async_reactor_flush(void* arg) {
+    bool pending = false;
+    for(size_t priority = 0; priority < AsyncPriorities; ++priority) {
+        size_t count = async_woken.count[priority];
+        if(count == 0) continue;
+        asyncTask_t** tasks = async_woken.tasks[priority];
+        size_t pushed = threadPool_tryPushWorkBatch(async_ctrl.threads, priority, (void* (*)(void*))async_resume, (void**)tasks, count);
+        // Kept in wake order, the next flush hands them over first
+        memmove(tasks, &tasks[pushed], sizeof(*tasks) * (count - pushed));
+        async_woken.count[priority] = count - pushed;
+        pending |= (pushed < count);
+    }
+    return pending;
+}
+
+static void async_reactor_wake(asyncTask_t* task) {
+    size_t priority = task->priority;
+    if(async_woken.count[priority] == async_woken.capacity[priority]) {
+        if(async_woken.capacity[priority] > 0) async_reactor_flush(NULL);
+        if(async_woken.count[priority] == async_woken.capacity[priority]) {
+            size_t capacity = ((async_woken.capacity[priority] == 0) ? ASYNC_WAKE_BATCH : async_woken.capacity[priority] * 2);
+            asyncTask_t** tasks = realloc(async_woken.tasks[priority], sizeof(*tasks) * capacity);
+            if(tasks == NULL) {
+                // Out of memory the task can only be handed over directly
+                async_wake(task);
+                return;
+            }
+            async_woken.tasks[priority] = tasks;
+            async_woken.capacity[priority] = capacity;
+        }
+    }
+    async_woken.tasks[priority][async_woken.count[priority]++] = task;
+}
+
+static void async_group_done(asyncGroup_t* group, size_t index, void* ret) {
+    lock(&group->lock);
+    group->results[index] = ret;
+    if(group->first < 0) group->first = (ssize_t)index;
+    group->done += 1;
+    asyncTask_t* waiter = NULL;
+    if(group->waiter != NULL && group->done >= group->target) {
+        waiter = group->waiter;
+        group->waiter = NULL;
+    }
+    signal_broacast(&group->signal);
+    // The group can be released as soon as we unlock, only the waiter can be used from here on
+    unlock(&group->lock);
+    if(waiter != NULL) async_wake(waiter);
+}
+
+static void async_group_park(asyncTask_t* task, void* arg) {
+    asyncGroup_t* group = (asyncGroup_t*)arg;
+    lock(&group->lock);
+    if(group->done >= group->target) {
+        unlock(&group->lock);
+        async_wake(task);
+        return;
+    }
+    group->waiter = task;
+    unlock(&group->lock);
+}
+
+static void async_group_wait(asyncTask_t* task, asyncGroup_t* group, size_t target) {
+    lock(&group->lock);
+    group->target = target;
+    if(group->done >= target) {
+        unlock(&group->lock);
+        return;
+    }
+    if(task == NULL) {
+        // Not called from a task so the thread has to block
+        while(group->done < target) lock_wait(&group->lock, &group->signal);
+        unlock(&group->lock);
+        return;
+    }
+    unlock(&group->lock);
+    async_park(task, async_group_park, group);
+}
+
+static void async_finish(asyncTask_t* task, void* arg) {
+    if(task->group != NULL) {
+        // Group children hand their result to the group and are cleaned right away
+        asyncGroup_t* group = task->group;
+        size_t index = task->index;
+        void* ret = task->ret;
+        asyncTask_clean(&task);
+        async_group_done(group, index, ret);
+        return;
+    }
+    lock(&task->lock);
+    if(task->state == AsyncDetached) {
+        // Nobody will wait for a detached task so we have to clean it
+        unlock(&task->lock);
+        asyncTask_clean(&task);
+        return;
+    }
+    task->state = AsyncDead;
+    unlock_signal(&task->lock, &task->signal);
+}
+
+static void async_suspended(asyncTask_t* task, void* arg) {
+    lock(&task->lock);
+    if(task->state == AsyncDetached) {
+        // Detached while suspending, no one else will resume it
+        unlock(&task->lock);
+        async_wake(task);
+        return;
+    }
+    task->state = AsyncSuspended;
+    unlock_signal(&task->lock, &task->signal);
+}
+
+// Only tasks that can be cancelled or have a deadline pay for the task lock in the reactor callbacks
+static bool async_abortable(asyncTask_t* task) {
+    return (task->cancel != NULL || task->deadline_ms != 0);
+}
+
+// Called with the task lock held
+static void async_abort_arm(asyncTask_t* task, asyncAbort_t* abort, uint64_t deadline_ms) {
+    task->abort = abort;
+    abort->armed = (deadline_ms != 0);
+    if(abort->armed) reactor_timer_add(async_ctrl.reactor, abort->timer, deadline_ms, abort->expired, abort->arg);
+}
+
+// Called with the task lock held by the reactor thread once the task is about to be woken
+static void async_abort_disarm(asyncTask_t* task) {
+    asyncAbort_t* abort = task->abort;
+    task->abort = NULL;
+    if(abort != NULL && abort->armed) (void)reactor_timer_cancel(async_ctrl.reactor, abort->timer);
+}
+
+// Called with the task lock held
+static void async_abort_fire(asyncTask_t* task) {
+    asyncAbort_t* abort = task->abort;
+    if(abort == NULL) return;
+    // If the cancel fails the timer is already expiring and will wake the task
+    if(abort->armed && !reactor_timer_cancel(async_ctrl.reactor, abort->timer)) return;
+    abort->armed = true;
+    reactor_timer_add(async_ctrl.reactor, abort->timer, reactor_now_ms(), abort->expired, abort->arg);
+}
+
+static void async_io_ready(void* arg, uint32_t revents) {
+    asyncIo_t* io = (asyncIo_t*)arg;
+    io->revents = revents;
+    if(io->abortable) {
+        lock(&io->task->lock);
+        async_abort_disarm(io->task);
+        unlock(&io->task->lock);
+    }
+    async_reactor_wake(io->task);
+}
+
+static void async_io_aborted(void* arg) {
+    asyncIo_t* io = (asyncIo_t*)arg;
+    lock(&io->task->lock);
+    io->task->abort = NULL;
+    if(io->watching) reactor_unwatch(async_ctrl.reactor, &io->watch);
+    io->status = async_interrupted(io->task);
+    unlock(&io->task->lock);
+    // The deadline can not move while the task is suspended, the timer only fires when there is a reason
+    if(io->status == EAsync_Success) io->status = EAsync_Timeout;
+    async_reactor_wake(io->task);
+}
+
+static void async_io_park(asyncTask_t* task, void* arg) {
+    asyncIo_t* io = (asyncIo_t*)arg;
+    lock(&task->lock);
+    io->abortable = async_abortable(task);
+    if(async_interrupted(task) != EAsync_Success) {
+        // Cancelled since we checked, the reactor wakes us so a full work queue can not block this thread
+        async_abort_arm(task, &io->abort, reactor_now_ms());
+    }
+    else if(reactor_watch(async_ctrl.reactor, &io->watch, io->fd, io->events, async_io_ready, io) == 0) {
+        io->watching = true;
+        if(io->abortable) async_abort_arm(task, &io->abort, task->deadline_ms);
+    }
+    else {
+        io->revents = EPOLLERR;
+        unlock(&task->lock);
+        async_wake(task);
+        return;
+    }
+    unlock(&task->lock);
+}
+
+static EAsync_t async_await_io(asyncTask_t* task, int fd, uint32_t events) {
+    EAsync_t status = async_interrupted(task);
+    if(status != EAsync_Success) return status;
+
+    asyncIo_t io = {.task = task, .fd = fd, .events = events, .revents = 0, .status = EAsync_Success, .abortable = false, .watching = false};
+    io.abort = (asyncAbort_t){.timer = &io.timer, .expired = async_io_aborted, .arg = &io};
+    async_park(task, async_io_park, &io);
+    if(io.status != EAsync_Success) return io.status;
+    return ((io.revents & events) ? EAsync_Success : EAsync_Error);
+}
+
+static void async_sleep_expired(void* arg) {
+    asyncSleep_t* sleep = (asyncSleep_t*)arg;
+    if(sleep->abortable) {
+        lock(&sleep->task->lock);
+        sleep->task->abort = NULL;
+        unlock(&sleep->task->lock);
+    }
+    async_reactor_wake(sleep->task);
+}
+
+static void async_sleep_park(asyncTask_t* task, void* arg) {
+    asyncSleep_t* sleep = (asyncSleep_t*)arg;
+    lock(&task->lock);
+    // Sleeping past the deadline would only delay the task from giving up
+    if(task->deadline_ms != 0 && task->deadline_ms < sleep->deadline_ms) sleep->deadline_ms = task->deadline_ms;
+    if(async_interrupted(task) != EAsync_Success) sleep->deadline_ms = reactor_now_ms();
+    sleep->abortable = async_abortable(task);
+    if(sleep->abortable) async_abort_arm(task, &sleep->abort, sleep->deadline_ms);
+    else reactor_timer_add(async_ctrl.reactor, &sleep->timer, sleep->deadline_ms, async_sleep_expired, sleep);
+    unlock(&task->lock);
+}
+
+static void async_timer_expired(void* arg) {
+    asyncSleep_t* sleep = (asyncSleep_t*)arg;
+    lock(&sleep->periodic->lock);
+    sleep->periodic->pending = NULL;
+    unlock(&sleep->periodic->lock);
+    async_reactor_wake(sleep->task);
+}
+
+static void async_timer_park(asyncTask_t* task, void* arg) {
+    asyncSleep_t* sleep = (asyncSleep_t*)arg;
+    asyncTimer_t* timer = sleep->periodic;
+    lock(&timer->lock);
+    if(timer->stopped) {
+        unlock(&timer->lock);
+        async_wake(task);
+        return;
+    }
+    timer->pending = sleep;
+    reactor_timer_add(async_ctrl.reactor, &sleep->timer, sleep->deadline_ms, async_timer_expired, sleep);
+    unlock(&timer->lock);
+}
+
 static void async_entry(asyncTask_t* task) {
     if(task->state != AsyncDetached) task->state = AsyncRunning;
     task->ret = task->func(task, task->ret);
-    ucontext_t repor = task->caller_ctx;
-    async_set_state(task, AsyncDead);
-    setcontext(&repor);
+    async_cancel_unbind(task);
+    // The final state can only be published after we leave the task stack
+    async_switch_set(async_finish, NULL);
+    setcontext(&task->caller_ctx);
 }
 
 static void async_run(asyncTask_t* task) {
     getcontext(&task->callee_ctx);
-    task->callee_ctx.uc_stack.ss_sp = async_get_stack();
+    task->node = async_current_node();
+    task->callee_ctx.uc_stack.ss_sp = async_get_stack(task->node);
     task->callee_ctx.uc_stack.ss_size = DEFAULT_STACK_CAPACITY;
     task->callee_ctx.uc_link = 0;
     makecontext(&task->callee_ctx, (void (*)())async_entry, 1, task);
+    asyncTask_t* prev = async_current_swap(task);
     swapcontext(&task->caller_ctx, &task->callee_ctx);
-    // Executed after async_entry returns
-    if(task->state == AsyncDetached) {
-        asyncTask_clean(&task);
+    async_current_swap(prev);
+    // Executed after the task suspends or returns
+    async_switched(task);
+}
+
+EAsync_t async_engine_affinity(const char* cpus) {
+    if(async_ctrl.running) return EAsync_Busy;
+
+    // Only cpus we are allowed to run on are accepted, otherwise the threads would fail to start
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return EAsync_Error;
+
+    int* list = NULL;
+    size_t count = 0;
+    const char* str = cpus;
+    while(str != NULL && *str != '\0') {
+        char* end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if(end == str) break;
+        if(*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if(end == str) break;
+        }
+        if(first < 0 || last < first || last >= CPU_SETSIZE) break;
+        list = realloc(list, sizeof(*list) * (count + (last - first) + 1));
+        for(long cpu = first; cpu <= last; ++cpu) {
+            if(CPU_ISSET(cpu, &allowed)) list[count++] = (int)cpu;
+        }
+        str = ((*end == ',') ? end + 1 : end);
+        if(*end != ',' && *end != '\0') break;
     }
-    else if(task->state != AsyncDead && task->state != AsyncSuspended) {
-        async_set_state(task, AsyncSuspended);
+    if((str != NULL && *str != '\0') || (cpus != NULL && *cpus != '\0' && count == 0)) {
+        free(list);
+        return EAsync_Error;
     }
+
+    free(async_ctrl.cpus);
+    async_ctrl.cpus = list;
+    async_ctrl.cpus_count = count;
+    return EAsync_Success;
 }
 
-static void async_resume(asyncTask_t* task) {
-    swapcontext(&task->caller_ctx, &task->callee_ctx);
+EAsync_t async_engine_elastic(size_t min_threads, size_t max_threads, int latency_ms, int idle_ms) {
+    if(async_ctrl.running) return EAsync_Busy;
+    if(min_threads == 0 || max_threads < min_threads) return EAsync_Error;
+    async_ctrl.elastic = true;
+    async_ctrl.min_threads = min_threads;
+    async_ctrl.max_threads = max_threads;
+    async_ctrl.latency_ms = latency_ms;
+    async_ctrl.idle_ms = idle_ms;
+    return EAsync_Success;
+}
+
+void async_engine_stats(asyncStats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if(!async_ctrl.running) return;
+    threadPoolStats_t pool;
+    threadPool_getStats(async_ctrl.threads, &pool);
+    stats->threads = pool.threads;
+    stats->idle = pool.idle;
+    stats->pending = pool.pending;
+    stats->min_threads = pool.min_threads;
+    stats->max_threads = pool.max_threads;
+    stats->spawned = pool.spawned;
+    stats->retired = pool.retired;
+    stats->max_wait_us = pool.max_wait_us;
 }
 
 EAsync_t async_engine_start(size_t threads) {
     if(async_ctrl.running) return EAsync_Busy;
-    if((async_ctrl.threads = threadPool_create(0, threads)) == NULL) return EAsync_Mem;
+    // When pinned we default to one thread per listed cpu
+    if(threads == 0) threads = async_ctrl.cpus_count;
+    if(async_ctrl.elastic) {
+        // The queues must hold the work of the largest pool
+        if((async_ctrl.threads = threadPool_create(async_ctrl.max_threads * 2, async_ctrl.min_threads)) == NULL) return EAsync_Mem;
+        threadPool_setElastic(async_ctrl.threads, async_ctrl.min_threads, async_ctrl.max_threads, async_ctrl.latency_ms, async_ctrl.idle_ms);
+    }
+    else if((async_ctrl.threads = threadPool_create(0, threads)) == NULL) return EAsync_Mem;
+    if((async_ctrl.reactor = reactor_create()) == NULL) {
+        threadPool_destroy(&async_ctrl.threads, true);
+        return EAsync_Mem;
+    }
 
-    // Start with two stack available
-    async_ctrl.stacks_entries = 2;
-    async_ctrl.sps = malloc(sizeof(void*) * async_ctrl.stacks_entries);
-    async_ctrl.sps[0] = mmap(NULL, DEFAULT_STACK_CAPACITY, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0);
-    async_ctrl.sps[1] = mmap(NULL, DEFAULT_STACK_CAPACITY, PROT_WRITE|PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0);
+    for(size_t node = 0; node < ASYNC_MAX_NODES; ++node) {
+        async_ctrl.stacks[node].lock = LOCK_INITIALIZER;
+    }
+
+    if(async_ctrl.cpus_count > 0) {
+        // The reactor stays on the node of the first cpu so it shares caches with the workers it wakes
+        int* local = malloc(sizeof(*local) * async_ctrl.cpus_count);
+        size_t local_count = 0;
+        unsigned node = async_cpu_node(async_ctrl.cpus[0]);
+        for(size_t i = 0; i < async_ctrl.cpus_count; ++i) {
+            if(async_cpu_node(async_ctrl.cpus[i]) == node) local[local_count++] = async_ctrl.cpus[i];
+        }
+        reactor_setAffinity(async_ctrl.reactor, local, local_count);
+        threadPool_setAffinity(async_ctrl.threads, async_ctrl.cpus, async_ctrl.cpus_count);
+        free(local);
+    }
 
-    if(async_ctrl.sps[0] == NULL || async_ctrl.sps[1] == NULL) {
+    // Start with two stack available
+    unsigned node = async_current_node();
+    void* sp[2] = {async_new_stack(node), async_new_stack(node)};
+    if(sp[0] == NULL || sp[1] == NULL) {
+        if(sp[0] != NULL) munmap(sp[0], DEFAULT_STACK_CAPACITY);
+        if(sp[1] != NULL) munmap(sp[1], DEFAULT_STACK_CAPACITY);
+        reactor_destroy(&async_ctrl.reactor);
         threadPool_destroy(&async_ctrl.threads, true);
-        free(async_ctrl.sps);
         return EAsync_Mem;
     }
-    async_ctrl.lock = LOCK_INITIALIZER;
+    async_free_stack(sp[0], node);
+    async_free_stack(sp[1], node);
+
+    reactor_setFlush(async_ctrl.reactor, async_reactor_flush, NULL);
+    reactor_dispach(async_ctrl.reactor);
     threadPool_dispach(async_ctrl.threads);
     async_ctrl.running = true;
 
@@ -142,44 +664,103 @@ EAsync_t async_engine_start(size_t threads) {
 EAsync_t async_engine_stop() {
     if(!async_ctrl.running && !async_ctrl.threads) return EAsync_Success;
 
+    reactor_destroy(&async_ctrl.reactor);
     threadPool_destroy(&async_ctrl.threads, true);
     async_ctrl.running = false;
 
-    for(size_t i = 0; i < async_ctrl.stacks_entries; ++i) {
-        if(munmap(async_ctrl.sps[i], DEFAULT_STACK_CAPACITY) == 0) {
-//            void* ptr = async_ctrl.sps[i];
-//            do {
-//                ptr -= 4096;
-//            }while(munmap(ptr, DEFAULT_STACK_CAPACITY) == 0);
-        }
+    for(size_t priority = 0; priority < AsyncPriorities; ++priority) {
+        free(async_woken.tasks[priority]);
+        async_woken.tasks[priority] = NULL;
+        async_woken.count[priority] = 0;
+        async_woken.capacity[priority] = 0;
     }
-    free(async_ctrl.sps);
-    lock_destroy(&async_ctrl.lock);
+
+    async_release_stacks();
 
     return EAsync_Success;
 }
 
 asyncTask_t* async(void* (*func)(asyncTask_t*, void*), void* arg) {
+    return async_priority(AsyncPriorityRequest, func, arg);
+}
+
+static bool async_ready() {
     if(async_ctrl.running == false) {
 #ifdef ASYNC_DEFAULT_START
-        if(async_engine_start(0) != EAsync_Success) return NULL;
+        if(async_engine_start(0) != EAsync_Success) return false;
 #else
-        return NULL;
+        return false;
 #endif
     }
+    return true;
+}
 
+static asyncTask_t* async_task_new(asyncPriority_t priority, async_func_t func, void* arg, asyncGroup_t* group, size_t index) {
     asyncTask_t* task = calloc(1, sizeof(*task));
     task->ret = arg;
     task->func = func;
     task->lock = LOCK_INITIALIZER;
-    task->signal = SIGNAL_INITIALIZER;
+    signal_init(&task->signal);
+    task->priority = ((priority < AsyncPriorities) ? priority : AsyncPriorityBackground);
+    task->group = group;
+    task->index = index;
     task->state = AsyncUnborn;
-    
-    threadPool_pushWork(async_ctrl.threads, (void* (*)(void*))async_run, task);
+    return task;
+}
+
+static asyncTask_t* async_spawn(asyncPriority_t priority, async_func_t func, void* arg, asyncGroup_t* group, size_t index) {
+    if(!async_ready()) return NULL;
+
+    asyncTask_t* task = async_task_new(priority, func, arg, group, index);
+    threadPool_pushWorkPriority(async_ctrl.threads, task->priority, (void* (*)(void*))async_run, task);
+
+    return task;
+}
+
+asyncTask_t* async_priority(asyncPriority_t priority, void* (*func)(asyncTask_t*, void*), void* arg) {
+    return async_spawn(priority, func, arg, NULL, 0);
+}
+
+EAsync_t async_many(asyncPriority_t priority, async_func_t func, void** args, asyncTask_t** tasks, size_t count) {
+    if(!async_ready()) return EAsync_Error;
+    if(count == 0) return EAsync_Success;
+
+    for(size_t i = 0; i < count; ++i) {
+        tasks[i] = async_task_new(priority, func, args[i], NULL, 0);
+    }
+    threadPool_pushWorkBatch(async_ctrl.threads, tasks[0]->priority, (void* (*)(void*))async_run, (void**)tasks, count);
+
+    return EAsync_Success;
+}
+
+asyncTask_t* async_try(asyncPriority_t priority, async_func_t func, void* arg) {
+    if(!async_ready()) return NULL;
 
+    asyncTask_t* task = async_task_new(priority, func, arg, NULL, 0);
+    if(!threadPool_tryPushWorkPriority(async_ctrl.threads, task->priority, (void* (*)(void*))async_run, task)) {
+        asyncTask_clean_unborn(&task);
+        return NULL;
+    }
     return task;
 }
 
+size_t async_try_many(asyncPriority_t priority, async_func_t func, void** args, asyncTask_t** tasks, size_t count) {
+    if(!async_ready() || count == 0) return 0;
+
+    for(size_t i = 0; i < count; ++i) {
+        tasks[i] = async_task_new(priority, func, args[i], NULL, 0);
+    }
+    size_t started = threadPool_tryPushWorkBatch(async_ctrl.threads, tasks[0]->priority, (void* (*)(void*))async_run, (void**)tasks, count);
+    for(size_t i = started; i < count; ++i) {
+        asyncTask_clean_unborn(&tasks[i]);
+    }
+    return started;
+}
+
+__attribute__((noinline)) asyncTask_t* async_self() {
+    return async_current;
+}
+
 void suspend(asyncTask_t* task, void* yield) {
     lock(&task->lock);
     task->ret = yield;
@@ -187,15 +768,8 @@ void suspend(asyncTask_t* task, void* yield) {
         unlock(&task->lock);
         return;
     }
-    task->state = AsyncSuspended;
-    getcontext(&task->callee_ctx);
-    // Note we will be resumed here so we do need to check the state
-    if(task->state == AsyncSuspended) {
-        // We have to copy the context because after the unlock it's possible for the task to be cleanup
-        ucontext_t restore = task->caller_ctx;
-        unlock_signal(&task->lock, &task->signal);
-        setcontext(&restore);
-    }
+    unlock(&task->lock);
+    async_park(task, async_suspended, NULL);
 }
 
 void resume(asyncTask_t* task) {
@@ -203,8 +777,76 @@ void resume(asyncTask_t* task) {
         lock(&task->lock);
         task->state = AsyncRunning;
         unlock(&task->lock);
-        threadPool_pushWork(async_ctrl.threads, (void* (*)(void*))async_resume, task);
+        async_wake(task);
+    }
+}
+
+EAsync_t await_readable(asyncTask_t* task, int fd) {
+    return async_await_io(task, fd, REACTOR_READ);
+}
+
+EAsync_t await_writable(asyncTask_t* task, int fd) {
+    return async_await_io(task, fd, REACTOR_WRITE);
+}
+
+void async_sleep(asyncTask_t* task, int ms) {
+    if(async_interrupted(task) != EAsync_Success) return;
+    asyncSleep_t sleep = {.task = task, .periodic = NULL, .deadline_ms = reactor_now_ms() + ((ms > 0) ? ms : 0)};
+    sleep.abort = (asyncAbort_t){.timer = &sleep.timer, .expired = async_sleep_expired, .arg = &sleep};
+    async_park(task, async_sleep_park, &sleep);
+}
+
+asyncTimer_t* async_timer_create(int period_ms) {
+    asyncTimer_t* timer = calloc(1, sizeof(*timer));
+    if(timer == NULL) return NULL;
+    timer->lock = LOCK_INITIALIZER;
+    timer->period_ms = ((period_ms > 0) ? period_ms : 1);
+    timer->next_ms = reactor_now_ms();
+    return timer;
+}
+
+bool async_timer_wait(asyncTask_t* task, asyncTimer_t* timer) {
+    asyncSleep_t sleep = {.task = task, .periodic = timer};
+    if(async_interrupted(task) != EAsync_Success) return false;
+
+    lock(&timer->lock);
+    if(timer->stopped) {
+        unlock(&timer->lock);
+        return false;
+    }
+    uint64_t now = reactor_now_ms();
+    timer->next_ms += timer->period_ms;
+    if(timer->next_ms < now) {
+        // Skip the ticks we missed instead of firing them back to back
+        timer->next_ms += ((now - timer->next_ms + timer->period_ms - 1) / timer->period_ms) * timer->period_ms;
+    }
+    sleep.deadline_ms = timer->next_ms;
+    unlock(&timer->lock);
+
+    async_park(task, async_timer_park, &sleep);
+
+    lock(&timer->lock);
+    bool stopped = timer->stopped;
+    unlock(&timer->lock);
+    return !stopped;
+}
+
+void async_timer_stop(asyncTimer_t* timer) {
+    lock(&timer->lock);
+    timer->stopped = true;
+    asyncSleep_t* sleep = timer->pending;
+    // If the cancel fails the timer is already expiring and will wake the task
+    if(sleep != NULL && reactor_timer_cancel(async_ctrl.reactor, &sleep->timer)) {
+        timer->pending = NULL;
+        async_wake(sleep->task);
     }
+    unlock(&timer->lock);
+}
+
+void async_timer_destroy(asyncTimer_t** timer) {
+    lock_destroy(&(*timer)->lock);
+    free(*timer);
+    *timer = NULL;
 }
 
 asyncYield_t wait_yield(asyncTask_t** task, asyncState_t* state) {
@@ -295,6 +937,164 @@ void async_detach(asyncTask_t** task) {
     unlock(&(*task)->lock);
 
     if(state == AsyncSuspended) {
-        threadPool_pushWork(async_ctrl.threads, (void* (*)(void*))async_resume, *task);
+        async_wake(*task);
     }
 }
+
+asyncGroup_t* async_group_create(asyncTask_t* parent) {
+    asyncGroup_t* group = calloc(1, sizeof(*group));
+    if(group == NULL) return NULL;
+    group->lock = LOCK_INITIALIZER;
+    signal_init(&group->signal);
+    group->parent = parent;
+    group->first = -1;
+    return group;
+}
+
+EAsync_t async_group_spawn(asyncGroup_t* group, async_func_t func, void* arg) {
+    lock(&group->lock);
+    if(group->cancelled) {
+        unlock(&group->lock);
+        return EAsync_Error;
+    }
+    if(group->count == group->capacity) {
+        size_t capacity = ((group->capacity > 0) ? group->capacity * 2 : 4);
+        void** results = realloc(group->results, sizeof(void*) * capacity);
+        if(results == NULL) {
+            unlock(&group->lock);
+            return EAsync_Mem;
+        }
+        group->results = results;
+        group->capacity = capacity;
+    }
+    size_t index = group->count++;
+    group->results[index] = NULL;
+    unlock(&group->lock);
+
+    // Children run with the priority of the task that owns the group
+    asyncPriority_t priority = ((group->parent != NULL) ? group->parent->priority : AsyncPriorityRequest);
+    if(async_spawn(priority, func, arg, group, index) == NULL) {
+        // The slot is already taken so it has to be completed for the waiters
+        async_group_done(group, index, NULL);
+        return EAsync_Error;
+    }
+    return EAsync_Success;
+}
+
+void async_group_cancel(asyncGroup_t* group) {
+    lock(&group->lock);
+    group->cancelled = true;
+    unlock(&group->lock);
+}
+
+bool async_cancelled(asyncTask_t* task) {
+    return (async_interrupted(task) != EAsync_Success);
+}
+
+asyncCancel_t* async_cancel_create() {
+    asyncCancel_t* token = calloc(1, sizeof(*token));
+    if(token == NULL) return NULL;
+    token->lock = LOCK_INITIALIZER;
+    token->refs = 1;
+    return token;
+}
+
+void async_cancel_release(asyncCancel_t** token) {
+    lock(&(*token)->lock);
+    bool last = (--(*token)->refs == 0);
+    unlock(&(*token)->lock);
+    if(last) {
+        lock_destroy(&(*token)->lock);
+        free(*token);
+    }
+    *token = NULL;
+}
+
+void async_cancel(asyncCancel_t* token) {
+    lock(&token->lock);
+    atomic_store(&token->cancelled, true);
+    if(token->task != NULL) {
+        // The task can not finish while we hold the token since it has to unbind itself first
+        lock(&token->task->lock);
+        async_abort_fire(token->task);
+        unlock(&token->task->lock);
+    }
+    unlock(&token->lock);
+}
+
+bool async_cancel_requested(asyncCancel_t* token) {
+    return atomic_load(&token->cancelled);
+}
+
+void async_set_cancel(asyncTask_t* task, asyncCancel_t* token) {
+    async_cancel_unbind(task);
+    if(token == NULL) return;
+    lock(&token->lock);
+    token->refs += 1;
+    token->task = task;
+    unlock(&token->lock);
+    task->cancel = token;
+}
+
+void async_set_deadline(asyncTask_t* task, int ms) {
+    lock(&task->lock);
+    task->deadline_ms = ((ms > 0) ? reactor_now_ms() + ms : 0);
+    unlock(&task->lock);
+}
+
+EAsync_t async_interrupted(asyncTask_t* task) {
+    uint64_t now = 0;
+    // A task is interrupted if it or any task it was spawned under was cancelled or ran out of time
+    while(task != NULL) {
+        if(task->cancel != NULL && atomic_load(&task->cancel->cancelled)) return EAsync_Cancelled;
+        if(task->deadline_ms != 0) {
+            if(now == 0) now = reactor_now_ms();
+            if(now >= task->deadline_ms) return EAsync_Timeout;
+        }
+        if(task->group == NULL) break;
+        if(task->group->cancelled) return EAsync_Cancelled;
+        task = task->group->parent;
+    }
+    return EAsync_Success;
+}
+
+EAsync_t async_all(asyncTask_t* task, asyncGroup_t* group, void** results) {
+    lock(&group->lock);
+    size_t count = group->count;
+    unlock(&group->lock);
+
+    async_group_wait(task, group, count);
+
+    lock(&group->lock);
+    if(results != NULL) memcpy(results, group->results, sizeof(void*) * count);
+    bool cancelled = group->cancelled;
+    unlock(&group->lock);
+    return (cancelled ? EAsync_Error : EAsync_Success);
+}
+
+ssize_t async_any(asyncTask_t* task, asyncGroup_t* group, void** result) {
+    lock(&group->lock);
+    size_t count = group->count;
+    unlock(&group->lock);
+    if(count == 0) return -1;
+
+    async_group_wait(task, group, 1);
+
+    lock(&group->lock);
+    ssize_t first = group->first;
+    if(result != NULL) *result = group->results[first];
+    // The remaining children are no longer needed
+    group->cancelled = true;
+    unlock(&group->lock);
+    return first;
+}
+
+void async_group_destroy(asyncTask_t* task, asyncGroup_t** group) {
+    async_group_cancel(*group);
+    async_group_wait(task, *group, (*group)->count);
+    lock_destroy(&(*group)->lock);
+    signal_destroy(&(*group)->signal);
+    free((*group)->results);
+    free(*group);
+    *group = NULL;
+}
@@ -4,9 +4,13 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 typedef struct asyncTask_t asyncTask_t;
 typedef struct asyncYield_t asyncYield_t;
+typedef struct asyncTimer_t asyncTimer_t;
+typedef struct asyncGroup_t asyncGroup_t;
+typedef struct asyncCancel_t asyncCancel_t;
 typedef void* (*async_func_t)(asyncTask_t*, void*);
 
 typedef enum {
@@ -17,11 +21,21 @@ typedef enum {
     AsyncDetached,
 }asyncState_t;
 
+// Tasks of a more urgent class are scheduled first when the engine is saturated
+typedef enum {
+    AsyncPriorityCritical = 0,  // I/O loops, e.g. accept/read loops
+    AsyncPriorityRequest,       // Default class used by async()
+    AsyncPriorityBackground,    // Maintenance jobs
+    AsyncPriorities
+}asyncPriority_t;
+
 typedef enum {
     EAsync_Success = 0,
     EAsync_Busy,
     EAsync_Mem,
-    EAsync_Error
+    EAsync_Error,
+    EAsync_Cancelled,   // The task cancellation token was triggered
+    EAsync_Timeout      // The task deadline expired
 }EAsync_t;
 
 typedef union {
@@ -49,16 +63,107 @@ struct asyncYield_t {
     yield_t yield;
 };
 
+typedef struct asyncStats_t {
+    size_t threads;         // Live engine threads
+    size_t idle;            // Threads waiting for work
+    size_t pending;         // Tasks ready and not picked yet
+    size_t min_threads;
+    size_t max_threads;
+    size_t spawned;         // Threads added by the elastic mode
+    size_t retired;         // Threads that left after being idle
+    uint64_t max_wait_us;   // Longest time a task waited for a thread since the last read, elastic mode only
+} asyncStats_t;
+
+// Pins the engine threads to a cpu list such as "0-3,8", must be called before the engine starts
+EAsync_t async_engine_affinity(const char* cpus);
+
+// Lets the engine grow from min_threads up to max_threads when tasks wait longer than latency_ms for a thread
+// or every thread is blocked, threads idle for idle_ms are retired. Must be called before the engine starts,
+// a zero latency_ms or idle_ms selects the defaults
+EAsync_t async_engine_elastic(size_t min_threads, size_t max_threads, int latency_ms, int idle_ms);
+
 EAsync_t async_engine_start(size_t threads);
 
+void async_engine_stats(asyncStats_t* stats);
+
 EAsync_t async_engine_stop();
 
 asyncTask_t* async(void* (*func)(asyncTask_t*, void*), void* arg);
 
+asyncTask_t* async_priority(asyncPriority_t priority, void* (*func)(asyncTask_t*, void*), void* arg);
+
+// Starts one task per argument with a single dispatch to the engine
+EAsync_t async_many(asyncPriority_t priority, async_func_t func, void** args, asyncTask_t** tasks, size_t count);
+
+// Non blocking variants for callers that must not stall when the engine is saturated.
+// async_try returns NULL and async_try_many starts only the first tasks it returns the count of
+asyncTask_t* async_try(asyncPriority_t priority, async_func_t func, void* arg);
+
+size_t async_try_many(asyncPriority_t priority, async_func_t func, void** args, asyncTask_t** tasks, size_t count);
+
+// Task being executed by the calling thread, NULL outside of a task
+asyncTask_t* async_self();
+
 void suspend(asyncTask_t* task, void* yield);
 
 void resume(asyncTask_t* task);
 
+EAsync_t await_readable(asyncTask_t* task, int fd);
+
+EAsync_t await_writable(asyncTask_t* task, int fd);
+
+void async_sleep(asyncTask_t* task, int ms);
+
+asyncTimer_t* async_timer_create(int period_ms);
+
+bool async_timer_wait(asyncTask_t* task, asyncTimer_t* timer);
+
+void async_timer_stop(asyncTimer_t* timer);
+
+void async_timer_destroy(asyncTimer_t** timer);
+
+// Children of a group are owned by it, their return value is kept as the result and they must not
+// use suspend(). The waiting functions take the calling task, or NULL to block a non task thread
+asyncGroup_t* async_group_create(asyncTask_t* parent);
+
+EAsync_t async_group_spawn(asyncGroup_t* group, async_func_t func, void* arg);
+
+// Cancellation is cooperative, children are expected to check async_cancelled() and return early
+void async_group_cancel(asyncGroup_t* group);
+
+// True once the task, or a task it was spawned under, was cancelled or ran out of time
+bool async_cancelled(asyncTask_t* task);
+
+// Waits for every child, results are stored in spawn order. Returns EAsync_Error if the group was cancelled
+EAsync_t async_all(asyncTask_t* task, asyncGroup_t* group, void** results);
+
+// Waits for the first child to finish and cancels the others, returns its index or -1 if the group is empty
+ssize_t async_any(asyncTask_t* task, asyncGroup_t* group, void** result);
+
+// Cancels and waits for any child still running
+void async_group_destroy(asyncTask_t* task, asyncGroup_t** group);
+
+// Cancellation tokens let other threads abort a task at its suspend points. Await and sleep calls return early
+// once the token is triggered or the task deadline expires, async_timer_wait() only checks it before suspending
+// and group children see it through async_cancelled(). The creator of a token releases it, the task holds its own reference
+asyncCancel_t* async_cancel_create();
+
+void async_cancel_release(asyncCancel_t** token);
+
+// Thread safe and idempotent, wakes the bound task if it is suspended in an await or sleep
+void async_cancel(asyncCancel_t* token);
+
+bool async_cancel_requested(asyncCancel_t* token);
+
+// Binds the token to a task, replacing the previous one. Must be called by the task itself or before it starts
+void async_set_cancel(asyncTask_t* task, asyncCancel_t* token);
+
+// Bounds the task to ms from now, zero or less removes the deadline. Same rules as async_set_cancel()
+void async_set_deadline(asyncTask_t* task, int ms);
+
+// EAsync_Success while the task can go on, EAsync_Cancelled or EAsync_Timeout otherwise
+EAsync_t async_interrupted(asyncTask_t* task);
+
 asyncYield_t wait_yield(asyncTask_t** task, asyncState_t* state);
 
 asyncYield_t get_yield(asyncTask_t** task, asyncState_t* state);
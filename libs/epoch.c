@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <lock.h>
+#include <epoch.h>
+
+// Data retired in epoch e is released once the global epoch reaches e + EPOCH_GRACE
+#define EPOCH_GRACE     2
+// Low bit of a record epoch, set while its thread is in a critical section
+#define EPOCH_ACTIVE    1
+
+typedef struct epochRecord_t epochRecord_t;
+struct epochRecord_t {
+    _Atomic uint64_t epoch;
+    atomic_bool used;
+    size_t nesting;
+    epochRecord_t* next;
+};
+
+typedef struct epochRetired_t epochRetired_t;
+struct epochRetired_t {
+    void* ptr;
+    epoch_release_t release;
+    uint64_t epoch;
+    epochRetired_t* next;
+};
+
+static struct {
+    _Atomic uint64_t epoch;
+    // Records are never freed, the ones of threads that exited are reused
+    _Atomic(epochRecord_t*) records;
+    pthread_once_t once;
+    pthread_key_t key;
+    lock_t lock;
+    // Newest first so the ones that can be released are always at the end
+    epochRetired_t* retired;
+} epoch_ctrl = {.epoch = 1, .records = NULL, .once = PTHREAD_ONCE_INIT, .retired = NULL};
+
+static __thread epochRecord_t* epoch_self = NULL;
+
+static void epoch_thread_exit(void* arg) {
+    epochRecord_t* record = (epochRecord_t*)arg;
+    record->nesting = 0;
+    atomic_store(&record->epoch, 0);
+    atomic_store(&record->used, false);
+}
+
+static void epoch_init() {
+    pthread_key_create(&epoch_ctrl.key, epoch_thread_exit);
+    lock_init(&epoch_ctrl.lock);
+}
+
+static epochRecord_t* epoch_record() {
+    if(epoch_self != NULL) return epoch_self;
+    pthread_once(&epoch_ctrl.once, epoch_init);
+
+    epochRecord_t* record;
+    for(record = atomic_load(&epoch_ctrl.records); record != NULL; record = record->next) {
+        if(!atomic_load(&record->used) && !atomic_exchange(&record->used, true)) break;
+    }
+    if(record == NULL) {
+        record = calloc(1, sizeof(*record));
+        atomic_store(&record->used, true);
+        record->next = atomic_load(&epoch_ctrl.records);
+        while(!atomic_compare_exchange_weak(&epoch_ctrl.records, &record->next, record));
+    }
+    // The key destructor gives the record back when the thread exits
+    pthread_setspecific(epoch_ctrl.key, record);
+    epoch_self = record;
+    return record;
+}
+
+// Called with the lock held, the epoch only moves once every reader saw the current one
+static bool epoch_try_advance() {
+    uint64_t epoch = atomic_load(&epoch_ctrl.epoch);
+    for(epochRecord_t* record = atomic_load(&epoch_ctrl.records); record != NULL; record = record->next) {
+        uint64_t local = atomic_load(&record->epoch);
+        if((local & EPOCH_ACTIVE) && (local >> 1) != epoch) return false;
+    }
+    atomic_store(&epoch_ctrl.epoch, epoch + 1);
+    return true;
+}
+
+// Called with the lock held, detaches what can be released
+static epochRetired_t* epoch_collect() {
+    uint64_t epoch = atomic_load(&epoch_ctrl.epoch);
+    epochRetired_t** link = &epoch_ctrl.retired;
+    while(*link != NULL && (*link)->epoch + EPOCH_GRACE > epoch) link = &(*link)->next;
+    epochRetired_t* ready = *link;
+    *link = NULL;
+    return ready;
+}
+
+static void epoch_release(epochRetired_t* ready) {
+    while(ready != NULL) {
+        epochRetired_t* next = ready->next;
+        if(ready->release != NULL) ready->release(ready->ptr);
+        else free(ready->ptr);
+        free(ready);
+        ready = next;
+    }
+}
+
+void epoch_enter() {
+    epochRecord_t* record = epoch_record();
+    if(record->nesting++ > 0) return;
+    atomic_store(&record->epoch, (atomic_load(&epoch_ctrl.epoch) << 1) | EPOCH_ACTIVE);
+    // Our reads must not be seen before the record is, otherwise a writer could release what we read
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit() {
+    epochRecord_t* record = epoch_self;
+    if(--record->nesting > 0) return;
+    atomic_store_explicit(&record->epoch, 0, memory_order_release);
+}
+
+void epoch_retire(void* ptr, epoch_release_t release) {
+    if(ptr == NULL) return;
+    epochRetired_t* item = malloc(sizeof(*item));
+    item->ptr = ptr;
+    item->release = release;
+
+    pthread_once(&epoch_ctrl.once, epoch_init);
+    lock(&epoch_ctrl.lock);
+    item->epoch = atomic_load(&epoch_ctrl.epoch);
+    item->next = epoch_ctrl.retired;
+    epoch_ctrl.retired = item;
+    (void)epoch_try_advance();
+    epochRetired_t* ready = epoch_collect();
+    unlock(&epoch_ctrl.lock);
+
+    epoch_release(ready);
+}
+
+void epoch_reclaim() {
+    pthread_once(&epoch_ctrl.once, epoch_init);
+    lock(&epoch_ctrl.lock);
+    if(epoch_ctrl.retired != NULL) (void)epoch_try_advance();
+    epochRetired_t* ready = epoch_collect();
+    unlock(&epoch_ctrl.lock);
+
+    epoch_release(ready);
+}
+
+void epoch_flush() {
+    pthread_once(&epoch_ctrl.once, epoch_init);
+    lock(&epoch_ctrl.lock);
+    uint64_t target = atomic_load(&epoch_ctrl.epoch) + EPOCH_GRACE;
+    while(atomic_load(&epoch_ctrl.epoch) < target) {
+        if(epoch_try_advance()) continue;
+        // Readers never wait for writers so they will leave soon
+        unlock(&epoch_ctrl.lock);
+        sched_yield();
+        lock(&epoch_ctrl.lock);
+    }
+    epochRetired_t* ready = epoch_collect();
+    unlock(&epoch_ctrl.lock);
+
+    epoch_release(ready);
+}
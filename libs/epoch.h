@@ -0,0 +1,27 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Epoch based reclamation. Readers access shared data between epoch_enter() and epoch_exit()
+// without taking locks, writers unlink the old data and hand it to epoch_retire(). It is only
+// released once every reader that could still see it left its critical section.
+// Critical sections can be nested but must not suspend the calling task.
+
+typedef void (*epoch_release_t)(void*);
+
+void epoch_enter();
+
+void epoch_exit();
+
+// Releases ptr with release, or free() when NULL, once no reader can hold it anymore
+void epoch_retire(void* ptr, epoch_release_t release);
+
+// Releases what is already safe to release without waiting, for writers that retire rarely
+void epoch_reclaim();
+
+// Releases everything retired so far, waiting for the readers still in a critical section
+void epoch_flush();
+
+#endif
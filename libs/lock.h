@@ -3,9 +3,234 @@
 
 #include <pthread.h>
 
+#ifdef LOCK_FUTEX
+
+// Futex based implementation, selected at build time with -DLOCK_FUTEX
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LOCK_INITIALIZER      (lock_t){0}
+#define SIGNAL_INITIALIZER    (signal_t){0}
+#define WRLOCK_INITIALIZER    (rwlock_t){0}
+
+#ifndef LOCK_SPIN_MAX
+#define LOCK_SPIN_MAX         100
+#endif
+#define LOCK_SPIN_MIN         (LOCK_SPIN_MAX / 10)
+#define RWLOCK_WRITER         0x80000000u
+
+// state: 0 unlocked, 1 locked, 2 locked with sleeping waiters
+// spins: moving average of the spins needed to get the lock, bounds the next spin
+typedef struct lock_t {
+    _Atomic uint32_t state;
+    _Atomic int32_t spins;
+} lock_t;
+
+// Waiters are tracked so signaling without anyone waiting never enters the kernel
+typedef struct signal_t {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+} signal_t;
+
+// state: number of readers or RWLOCK_WRITER, sleepers wait for seq to change
+typedef struct rwlock_t {
+    _Atomic uint32_t state;
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+} rwlock_t;
+
+static inline void lock_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static inline int futex_wait(_Atomic uint32_t* addr, uint32_t value, const struct timespec* timeout) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static inline void futex_wake(_Atomic uint32_t* addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline int lock_init(lock_t* lock) {
+    *lock = LOCK_INITIALIZER;
+    return 0;
+}
+
+static inline int lock_destroy(lock_t* lock) {
+    return 0;
+}
+
+static inline int trylock(lock_t* lock) {
+    uint32_t expected = 0;
+    return (atomic_compare_exchange_strong_explicit(&lock->state, &expected, 1, memory_order_acquire, memory_order_relaxed) ? 0 : EBUSY);
+}
+
+static inline void lock_slow(lock_t* lock) {
+    int32_t spins = atomic_load_explicit(&lock->spins, memory_order_relaxed);
+    int32_t max = ((spins * 2 + LOCK_SPIN_MIN < LOCK_SPIN_MAX) ? spins * 2 + LOCK_SPIN_MIN : LOCK_SPIN_MAX);
+    int32_t count = 0;
+    for(; count < max; ++count) {
+        if(atomic_load_explicit(&lock->state, memory_order_relaxed) == 0 && trylock(lock) == 0) {
+            atomic_store_explicit(&lock->spins, spins + (count - spins) / 8, memory_order_relaxed);
+            return;
+        }
+        lock_pause();
+    }
+    atomic_store_explicit(&lock->spins, spins + (count - spins) / 8, memory_order_relaxed);
+
+    // Marking the lock as contended makes the owner wake us on unlock
+    while(atomic_exchange_explicit(&lock->state, 2, memory_order_acquire) != 0) {
+        futex_wait(&lock->state, 2, NULL);
+    }
+}
+
+static inline void lock(lock_t* lock) {
+    if(trylock(lock) != 0) lock_slow(lock);
+}
+
+static inline void unlock(lock_t* lock) {
+    if(atomic_exchange_explicit(&lock->state, 0, memory_order_release) == 2) {
+        futex_wake(&lock->state, 1);
+    }
+}
+
+// Takes one waiter out of the count, the signaling side does it so a waiter that was
+// already woken but did not run yet is not woken again
+static inline bool signal_take(signal_t* signal) {
+    uint32_t waiters = atomic_load(&signal->waiters);
+    while(waiters > 0) {
+        if(atomic_compare_exchange_weak(&signal->waiters, &waiters, waiters - 1)) {
+            atomic_fetch_add(&signal->seq, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void lock_timedwait(lock_t* lock, signal_t* signal, int wait_ms) {
+    atomic_fetch_add(&signal->waiters, 1);
+    uint32_t seq = atomic_load(&signal->seq);
+    unlock(lock);
+    if(wait_ms > 0) {
+        // Futex timeouts are relative and measured against the monotonic clock
+        struct timespec timeout = {.tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000};
+        futex_wait(&signal->seq, seq, &timeout);
+    }
+    else futex_wait(&signal->seq, seq, NULL);
+    // Without any signal since we started waiting (timeout or spurious wake) nobody took us out
+    if(atomic_load(&signal->seq) == seq) {
+        uint32_t waiters = atomic_load(&signal->waiters);
+        while(waiters > 0 && !atomic_compare_exchange_weak(&signal->waiters, &waiters, waiters - 1));
+    }
+    if(trylock(lock) != 0) lock_slow(lock);
+}
+
+static inline void lock_wait(lock_t* lock, signal_t* signal) {
+    lock_timedwait(lock, signal, 0);
+}
+
+static inline int signal_init(signal_t* signal) {
+    *signal = SIGNAL_INITIALIZER;
+    return 0;
+}
+
+static inline int signal_destroy(signal_t* signal) {
+    return 0;
+}
+
+static inline void unlock_signal(lock_t* lock, signal_t* signal) {
+    // The waiter is taken while the signal is still protected by the lock, it might be
+    // released as soon as we unlock
+    bool wake = signal_take(signal);
+    unlock(lock);
+    if(wake) futex_wake(&signal->seq, 1);
+}
+
+static inline void signal_broacast(signal_t* signal) {
+    if(atomic_exchange(&signal->waiters, 0) > 0) {
+        atomic_fetch_add(&signal->seq, 1);
+        futex_wake(&signal->seq, INT_MAX);
+    }
+}
+
+static inline int rwlock_init(rwlock_t* lock) {
+    *lock = WRLOCK_INITIALIZER;
+    return 0;
+}
+
+static inline int rwlock_destroy(rwlock_t* lock) {
+    return 0;
+}
+
+static inline bool rwlock_try(rwlock_t* lock, bool writer) {
+    uint32_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    if(writer) {
+        return (state == 0 && atomic_compare_exchange_weak_explicit(&lock->state, &state, RWLOCK_WRITER, memory_order_acquire, memory_order_relaxed));
+    }
+    // Readers are preferred like the default pthread rwlock so recursive read locks stay safe
+    return (!(state & RWLOCK_WRITER) && atomic_compare_exchange_weak_explicit(&lock->state, &state, state + 1, memory_order_acquire, memory_order_relaxed));
+}
+
+static inline void rwlock_lock(rwlock_t* lock, bool writer) {
+    for(int count = 0; count < LOCK_SPIN_MAX; ++count) {
+        if(rwlock_try(lock, writer)) return;
+        lock_pause();
+    }
+    while(true) {
+        atomic_fetch_add(&lock->waiters, 1);
+        uint32_t seq = atomic_load(&lock->seq);
+        if(rwlock_try(lock, writer)) {
+            atomic_fetch_sub(&lock->waiters, 1);
+            return;
+        }
+        futex_wait(&lock->seq, seq, NULL);
+        atomic_fetch_sub(&lock->waiters, 1);
+    }
+}
+
+static inline int rwlock_read_lock(rwlock_t* lock) {
+    rwlock_lock(lock, false);
+    return 0;
+}
+
+static inline int rwlock_write_lock(rwlock_t* lock) {
+    rwlock_lock(lock, true);
+    return 0;
+}
+
+static inline int rwlock_unlock(rwlock_t* lock) {
+    uint32_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    bool released;
+    if(state == RWLOCK_WRITER) {
+        atomic_store(&lock->state, 0);
+        released = true;
+    }
+    else released = (atomic_fetch_sub(&lock->state, 1) == 1);
+
+    if(released && atomic_load(&lock->waiters) > 0) {
+        atomic_fetch_add(&lock->seq, 1);
+        futex_wake(&lock->seq, INT_MAX);
+    }
+    return 0;
+}
+
+#else
+
 #define LOCK_INITIALIZER      (lock_t)PTHREAD_MUTEX_INITIALIZER
+// Waits against the wall clock, only use it for signals that are never given to lock_timedwait()
 #define SIGNAL_INITIALIZER    (signal_t)PTHREAD_COND_INITIALIZER
-#define WRLOCK_INITIALIZER    (wrlock_t)PTHREAD_RWLOCK_INITIALIZER;
+#define WRLOCK_INITIALIZER    (rwlock_t)PTHREAD_RWLOCK_INITIALIZER
 
 typedef pthread_mutex_t lock_t;
 typedef pthread_cond_t  signal_t;
@@ -33,18 +258,15 @@ static inline void lock_wait(lock_t* lock, signal_t* signal) {
 
 static inline void lock_timedwait(lock_t* lock, signal_t* signal, int wait_ms) {
     if(wait_ms > 0) {
+        // Signals from signal_init() use the monotonic clock so wall clock changes do not affect the wait.
+        // A signal set with SIGNAL_INITIALIZER would see this deadline as long past and never sleep
         struct timespec time;
-        long sec = wait_ms / 1000;
-        const long nsec = (wait_ms % 1000) * 1000000;
-        clock_gettime(CLOCK_REALTIME, &time);
-        const long t = 1000000000 - time.tv_nsec;
-        if(t > nsec) {
-            time.tv_sec += sec;
-            time.tv_nsec += nsec;
-        }
-        else {
-            time.tv_sec += (sec + 1);
-            time.tv_nsec = nsec - t;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        time.tv_sec += wait_ms / 1000;
+        time.tv_nsec += (wait_ms % 1000) * 1000000;
+        if(time.tv_nsec >= 1000000000) {
+            time.tv_sec += 1;
+            time.tv_nsec -= 1000000000;
         }
         pthread_cond_timedwait((pthread_cond_t*)signal, (pthread_mutex_t*)lock, &time);
     }
@@ -56,7 +278,12 @@ static inline void unlock(lock_t* lock) {
 }
 
 static inline int signal_init(signal_t* signal) {
-    return pthread_cond_init((pthread_cond_t*) signal, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init((pthread_cond_t*) signal, &attr);
+    pthread_condattr_destroy(&attr);
+    return ret;
 }
 
 static inline int signal_destroy(signal_t* signal) {
@@ -92,4 +319,115 @@ static inline int rwlock_unlock(rwlock_t* lock) {
     return pthread_rwlock_unlock((pthread_rwlock_t*)lock);
 }
 
+#endif
+
+// Prints the lock contention report to fd, only lock profiling builds have data to report
+void lock_profile_report(int fd);
+
+#ifdef LOCK_PROFILE
+
+// Contention profiling on top of either implementation, selected at build time with -DLOCK_PROFILE.
+// Every call site gets its own counters, registered the first time it takes a lock
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Wait histogram, bucket i counts the waits shorter than 256ns << i and the last one the rest
+#define LOCK_PROFILE_BUCKETS  16
+
+typedef struct lockSite_t lockSite_t;
+struct lockSite_t {
+    const char* file;
+    int line;
+    const char* func;
+    const char* kind;
+    atomic_bool registered;
+    lockSite_t* next;
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t wait_max_ns;
+    _Atomic uint64_t hold_ns;
+    _Atomic uint64_t hold_max_ns;
+    _Atomic uint64_t waits[LOCK_PROFILE_BUCKETS];
+};
+
+uint64_t lock_profile_now();
+
+// Hold times are tracked per thread from acquired to released
+void lock_profile_acquired(lockSite_t* site, const void* lock, bool contended, uint64_t wait_ns);
+
+void lock_profile_released(const void* lock);
+
+static inline void lock_profiled(lock_t* l, lockSite_t* site) {
+    if(trylock(l) == 0) {
+        lock_profile_acquired(site, l, false, 0);
+        return;
+    }
+    uint64_t start = lock_profile_now();
+    lock(l);
+    lock_profile_acquired(site, l, true, lock_profile_now() - start);
+}
+
+static inline int trylock_profiled(lock_t* l, lockSite_t* site) {
+    int ret = trylock(l);
+    if(ret == 0) lock_profile_acquired(site, l, false, 0);
+    return ret;
+}
+
+static inline void unlock_profiled(lock_t* l) {
+    lock_profile_released(l);
+    unlock(l);
+}
+
+// Time spent waiting for the signal is not contention, the lock is taken again as a new acquisition
+static inline void lock_timedwait_profiled(lock_t* l, signal_t* signal, int wait_ms, lockSite_t* site) {
+    lock_profile_released(l);
+    lock_timedwait(l, signal, wait_ms);
+    lock_profile_acquired(site, l, false, 0);
+}
+
+static inline void unlock_signal_profiled(lock_t* l, signal_t* signal) {
+    lock_profile_released(l);
+    unlock_signal(l, signal);
+}
+
+static inline bool rwlock_try_profiled(rwlock_t* l, bool writer) {
+#ifdef LOCK_FUTEX
+    return rwlock_try(l, writer);
+#else
+    return ((writer ? pthread_rwlock_trywrlock(l) : pthread_rwlock_tryrdlock(l)) == 0);
+#endif
+}
+
+static inline int rwlock_lock_profiled(rwlock_t* l, bool writer, lockSite_t* site) {
+    if(rwlock_try_profiled(l, writer)) {
+        lock_profile_acquired(site, l, false, 0);
+        return 0;
+    }
+    uint64_t start = lock_profile_now();
+    int ret = (writer ? rwlock_write_lock(l) : rwlock_read_lock(l));
+    lock_profile_acquired(site, l, true, lock_profile_now() - start);
+    return ret;
+}
+
+static inline int rwlock_unlock_profiled(rwlock_t* l) {
+    lock_profile_released(l);
+    return rwlock_unlock(l);
+}
+
+#define LOCK_SITE(type)                 static lockSite_t lock_site = {.file = __FILE__, .line = __LINE__, .func = __func__, .kind = type}
+
+#define lock(l)                         ({ LOCK_SITE("lock"); lock_profiled((l), &lock_site); })
+#define trylock(l)                      ({ LOCK_SITE("trylock"); trylock_profiled((l), &lock_site); })
+#define unlock(l)                       unlock_profiled(l)
+#define lock_wait(l, s)                 ({ LOCK_SITE("wait"); lock_timedwait_profiled((l), (s), 0, &lock_site); })
+#define lock_timedwait(l, s, ms)        ({ LOCK_SITE("wait"); lock_timedwait_profiled((l), (s), (ms), &lock_site); })
+#define unlock_signal(l, s)             unlock_signal_profiled((l), (s))
+#define rwlock_read_lock(l)             ({ LOCK_SITE("read"); rwlock_lock_profiled((l), false, &lock_site); })
+#define rwlock_write_lock(l)            ({ LOCK_SITE("write"); rwlock_lock_profiled((l), true, &lock_site); })
+#define rwlock_unlock(l)                rwlock_unlock_profiled(l)
+
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <lock.h>
+
+#ifdef LOCK_PROFILE
+
+#include <stdlib.h>
+#include <time.h>
+
+// Locks held by a thread at the same time, deeper nesting is not timed
+#define LOCK_PROFILE_DEPTH  16
+
+typedef struct lockHeld_t {
+    const void* lock;
+    lockSite_t* site;
+    uint64_t acquired_ns;
+} lockHeld_t;
+
+static _Atomic(lockSite_t*) lock_sites = NULL;
+static __thread lockHeld_t lock_held[LOCK_PROFILE_DEPTH];
+static __thread size_t lock_held_count = 0;
+
+static void lock_profile_max(_Atomic uint64_t* max, uint64_t value) {
+    uint64_t current = atomic_load_explicit(max, memory_order_relaxed);
+    while(value > current && !atomic_compare_exchange_weak_explicit(max, &current, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+static size_t lock_profile_bucket(uint64_t wait_ns) {
+    size_t bucket = 0;
+    for(wait_ns >>= 8; wait_ns > 0 && bucket < LOCK_PROFILE_BUCKETS - 1; wait_ns >>= 1) bucket += 1;
+    return bucket;
+}
+
+uint64_t lock_profile_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+void lock_profile_acquired(lockSite_t* site, const void* lock, bool contended, uint64_t wait_ns) {
+    // Sites are static so they are registered once and never removed
+    if(!atomic_load_explicit(&site->registered, memory_order_acquire) && !atomic_exchange(&site->registered, true)) {
+        site->next = atomic_load(&lock_sites);
+        while(!atomic_compare_exchange_weak(&lock_sites, &site->next, site));
+    }
+
+    atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+    if(contended) {
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->wait_ns, wait_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->waits[lock_profile_bucket(wait_ns)], 1, memory_order_relaxed);
+        lock_profile_max(&site->wait_max_ns, wait_ns);
+    }
+
+    if(lock_held_count < LOCK_PROFILE_DEPTH) {
+        lock_held[lock_held_count++] = (lockHeld_t){lock, site, lock_profile_now()};
+    }
+}
+
+void lock_profile_released(const void* lock) {
+    // Locks are usually released in reverse order, search from the most recent one
+    for(size_t i = lock_held_count; i > 0; --i) {
+        if(lock_held[i - 1].lock != lock) continue;
+        lockSite_t* site = lock_held[i - 1].site;
+        uint64_t hold_ns = lock_profile_now() - lock_held[i - 1].acquired_ns;
+        atomic_fetch_add_explicit(&site->hold_ns, hold_ns, memory_order_relaxed);
+        lock_profile_max(&site->hold_max_ns, hold_ns);
+        lock_held[i - 1] = lock_held[--lock_held_count];
+        return;
+    }
+}
+
+static int lock_profile_compare(const void* a, const void* b) {
+    uint64_t wait_a = atomic_load(&(*(lockSite_t**)a)->wait_ns);
+    uint64_t wait_b = atomic_load(&(*(lockSite_t**)b)->wait_ns);
+    if(wait_a != wait_b) return ((wait_a < wait_b) ? 1 : -1);
+    uint64_t count_a = atomic_load(&(*(lockSite_t**)a)->acquisitions);
+    uint64_t count_b = atomic_load(&(*(lockSite_t**)b)->acquisitions);
+    return ((count_a < count_b) ? 1 : ((count_a > count_b) ? -1 : 0));
+}
+
+void lock_profile_report(int fd) {
+    size_t count = 0;
+    for(lockSite_t* site = atomic_load(&lock_sites); site != NULL; site = site->next) count += 1;
+    lockSite_t** sites = malloc(sizeof(*sites) * (count + 1));
+    count = 0;
+    for(lockSite_t* site = atomic_load(&lock_sites); site != NULL; site = site->next) sites[count++] = site;
+    qsort(sites, count, sizeof(*sites), lock_profile_compare);
+
+    dprintf(fd, "Lock contention report, %zu sites sorted by total wait\n", count);
+    dprintf(fd, "%-40s %-7s %12s %10s %12s %12s %12s %12s %12s\n", "site", "kind", "acquired", "contended",
+        "wait ms", "avg wait ns", "max wait us", "avg hold ns", "max hold us");
+    for(size_t i = 0; i < count; ++i) {
+        lockSite_t* site = sites[i];
+        uint64_t acquisitions = atomic_load(&site->acquisitions);
+        uint64_t contended = atomic_load(&site->contended);
+        uint64_t wait_ns = atomic_load(&site->wait_ns);
+        char name[256];
+        snprintf(name, sizeof(name), "%s:%d %s", site->file, site->line, site->func);
+        dprintf(fd, "%-40s %-7s %12llu %9.2f%% %12.3f %12llu %12llu %12llu %12llu\n", name, site->kind,
+            (unsigned long long)acquisitions, ((acquisitions > 0) ? (100.0 * contended) / acquisitions : 0.0),
+            (double)wait_ns / 1000000, (unsigned long long)((contended > 0) ? wait_ns / contended : 0),
+            (unsigned long long)(atomic_load(&site->wait_max_ns) / 1000),
+            (unsigned long long)((acquisitions > 0) ? atomic_load(&site->hold_ns) / acquisitions : 0),
+            (unsigned long long)(atomic_load(&site->hold_max_ns) / 1000));
+        if(contended == 0) continue;
+        // Only the buckets with waits, labeled by their upper bound
+        dprintf(fd, "    waits:");
+        for(size_t bucket = 0; bucket < LOCK_PROFILE_BUCKETS; ++bucket) {
+            uint64_t waits = atomic_load(&site->waits[bucket]);
+            if(waits == 0) continue;
+            uint64_t bound = (256ull << bucket);
+            if(bucket == LOCK_PROFILE_BUCKETS - 1) dprintf(fd, " >=%lluus:%llu", (unsigned long long)(bound / 2000), (unsigned long long)waits);
+            else if(bound < 1000) dprintf(fd, " <%lluns:%llu", (unsigned long long)bound, (unsigned long long)waits);
+            else dprintf(fd, " <%lluus:%llu", (unsigned long long)(bound / 1000), (unsigned long long)waits);
+        }
+        dprintf(fd, "\n");
+    }
+    free(sites);
+}
+
+#else
+
+void lock_profile_report(int fd) {
+    dprintf(fd, "Lock profiling is disabled, build with LOCK_PROFILE=1\n");
+}
+
+#endif
@@ -41,6 +41,66 @@ void* pop(queue_t* queue) {
     return data;
 }
 
+void* try_pop(queue_t* queue) {
+    if(!queue->alive) return NULL;
+    lock(&queue->lock);
+    void* data = queue->array[queue->head];
+    if(data == NULL) {
+        unlock(&queue->lock);
+        return NULL;
+    }
+    queue->array[queue->head++] = NULL;
+    if(queue->head >= queue->size) queue->head = 0;
+    unlock_signal(&queue->lock, &queue->pop_signal);
+    return data;
+}
+
+size_t pop_many(queue_t* queue, void** data, size_t max) {
+    if(!queue->alive || max == 0) return 0;
+    lock(&queue->lock);
+    queue->pending += 1;
+    while(queue->head == queue->tail && queue->array[queue->head] == NULL) {
+        lock_wait(&queue->lock, &queue->push_signal);
+        if(!queue->alive) {
+            queue->pending -= 1;
+            unlock(&queue->lock);
+            return 0;
+        }
+    }
+    size_t count = 0;
+    while(count < max && queue->array[queue->head] != NULL) {
+        data[count++] = queue->array[queue->head];
+        queue->array[queue->head++] = NULL;
+        if(queue->head >= queue->size) queue->head = 0;
+    }
+    queue->pending -= 1;
+    // Several slots were released so every blocked producer gets a chance
+    if(count > 1) {
+        signal_broacast(&queue->pop_signal);
+        unlock(&queue->lock);
+    }
+    else unlock_signal(&queue->lock, &queue->pop_signal);
+    return count;
+}
+
+size_t try_pop_many(queue_t* queue, void** data, size_t max) {
+    if(!queue->alive || max == 0) return 0;
+    lock(&queue->lock);
+    size_t count = 0;
+    while(count < max && queue->array[queue->head] != NULL) {
+        data[count++] = queue->array[queue->head];
+        queue->array[queue->head++] = NULL;
+        if(queue->head >= queue->size) queue->head = 0;
+    }
+    if(count > 1) {
+        signal_broacast(&queue->pop_signal);
+        unlock(&queue->lock);
+    }
+    else if(count == 1) unlock_signal(&queue->lock, &queue->pop_signal);
+    else unlock(&queue->lock);
+    return count;
+}
+
 void push(queue_t* queue, void* data) {
     if(!queue->alive) return;
     lock(&queue->lock);
@@ -59,6 +119,36 @@ void push(queue_t* queue, void* data) {
     unlock_signal(&queue->lock, &queue->push_signal);
 }
 
+size_t push_many(queue_t* queue, void** data, size_t count) {
+    if(!queue->alive) return 0;
+    size_t pushed = 0;
+    lock(&queue->lock);
+    queue->pending += 1;
+    while(pushed < count) {
+        while(queue->tail == queue->head && queue->array[queue->tail] != NULL) {
+            // Let consumers see what we already pushed before waiting for room
+            signal_broacast(&queue->push_signal);
+            lock_wait(&queue->lock, &queue->pop_signal);
+            if(!queue->alive) {
+                queue->pending -= 1;
+                unlock(&queue->lock);
+                return pushed;
+            }
+        }
+        while(pushed < count && queue->array[queue->tail] == NULL) {
+            queue->array[queue->tail++] = data[pushed++];
+            if(queue->tail >= queue->size) queue->tail = 0;
+        }
+    }
+    queue->pending -= 1;
+    if(pushed > 1) {
+        signal_broacast(&queue->push_signal);
+        unlock(&queue->lock);
+    }
+    else unlock_signal(&queue->lock, &queue->push_signal);
+    return pushed;
+}
+
 queue_t* queue_create(size_t size) {
     queue_t* queue = calloc(1, sizeof(*queue) + (sizeof(void*) * size - sizeof(void*)));
     queue->size = size;
@@ -10,8 +10,19 @@ bool empty(queue_t* queue);
 
 void* pop(queue_t* queue);
 
+void* try_pop(queue_t* queue);
+
+// Blocks until at least one element is available and pops up to max of them, returns 0 once the queue is destroyed
+size_t pop_many(queue_t* queue, void** data, size_t max);
+
+// Pops up to max elements without blocking, returns 0 if the queue is empty
+size_t try_pop_many(queue_t* queue, void** data, size_t max);
+
 void push(queue_t* queue, void* data);
 
+// Blocks until every element is pushed, returns how many were pushed before the queue was destroyed
+size_t push_many(queue_t* queue, void** data, size_t count);
+
 queue_t* queue_create(size_t size);
 
 void queue_destroy(queue_t** queue);
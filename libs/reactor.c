@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <lock.h>
+#include <reactor.h>
+
+#define REACTOR_MAX_EVENTS  64
+#define REACTOR_TIMERS      16
+#define REACTOR_RETRY_MS    1
+#define TIMER_NOT_QUEUED    ((size_t)-1)
+
+struct reactor_t {
+    volatile bool running;
+    int epfd;
+    int wake_fd;
+    pthread_t thread;
+    bool pinned;
+    cpu_set_t cpus;
+    reactor_flush_cb_t flush;
+    void* flush_arg;
+    // Min heap ordered by deadline
+    lock_t timers_lock;
+    size_t timers_count;
+    size_t timers_capacity;
+    reactor_timer_t** timers;
+};
+
+static void reactor_timer_swap(reactor_t* reactor, size_t a, size_t b) {
+    reactor_timer_t* temp = reactor->timers[a];
+    reactor->timers[a] = reactor->timers[b];
+    reactor->timers[b] = temp;
+    reactor->timers[a]->index = a;
+    reactor->timers[b]->index = b;
+}
+
+static void reactor_timer_up(reactor_t* reactor, size_t i) {
+    while(i > 0 && reactor->timers[(i - 1) / 2]->deadline_ms > reactor->timers[i]->deadline_ms) {
+        reactor_timer_swap(reactor, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void reactor_timer_down(reactor_t* reactor, size_t i) {
+    while(true) {
+        size_t min = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if(left < reactor->timers_count && reactor->timers[left]->deadline_ms < reactor->timers[min]->deadline_ms) min = left;
+        if(right < reactor->timers_count && reactor->timers[right]->deadline_ms < reactor->timers[min]->deadline_ms) min = right;
+        if(min == i) break;
+        reactor_timer_swap(reactor, i, min);
+        i = min;
+    }
+}
+
+static void reactor_timer_remove(reactor_t* reactor, reactor_timer_t* timer) {
+    size_t i = timer->index;
+    reactor->timers_count -= 1;
+    if(i != reactor->timers_count) {
+        reactor->timers[i] = reactor->timers[reactor->timers_count];
+        reactor->timers[i]->index = i;
+        reactor_timer_down(reactor, i);
+        reactor_timer_up(reactor, i);
+    }
+    timer->index = TIMER_NOT_QUEUED;
+}
+
+static int reactor_next_timeout(reactor_t* reactor) {
+    lock(&reactor->timers_lock);
+    int timeout = -1;
+    if(reactor->timers_count > 0) {
+        uint64_t now = reactor_now_ms();
+        uint64_t deadline = reactor->timers[0]->deadline_ms;
+        timeout = ((deadline <= now) ? 0 : (int)(deadline - now));
+    }
+    unlock(&reactor->timers_lock);
+    return timeout;
+}
+
+static void reactor_fire_timers(reactor_t* reactor) {
+    uint64_t now = reactor_now_ms();
+    while(true) {
+        lock(&reactor->timers_lock);
+        if(reactor->timers_count == 0 || reactor->timers[0]->deadline_ms > now) {
+            unlock(&reactor->timers_lock);
+            break;
+        }
+        reactor_timer_t* timer = reactor->timers[0];
+        reactor_timer_cb_t cb = timer->cb;
+        void* arg = timer->arg;
+        reactor_timer_remove(reactor, timer);
+        unlock(&reactor->timers_lock);
+        // From here on the timer belongs to the caller again
+        cb(arg);
+    }
+}
+
+uint64_t reactor_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+static void* reactor_entry(void* arg) {
+    reactor_t* reactor = (reactor_t*)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    bool pending = false;
+
+    while(reactor->running) {
+        int timeout = reactor_next_timeout(reactor);
+        if(pending && (timeout < 0 || timeout > REACTOR_RETRY_MS)) timeout = REACTOR_RETRY_MS;
+        int ready = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, timeout);
+        for(int i = 0; i < ready; ++i) {
+            reactor_watch_t* watch = (reactor_watch_t*)events[i].data.ptr;
+            if(watch == NULL) {
+                eventfd_t value;
+                (void)eventfd_read(reactor->wake_fd, &value);
+                continue;
+            }
+            // Watches are one shot, after the callback the watch belongs to the caller again
+            epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+            watch->cb(watch->arg, events[i].events);
+        }
+        reactor_fire_timers(reactor);
+        if(reactor->flush != NULL) pending = reactor->flush(reactor->flush_arg);
+    }
+    return NULL;
+}
+
+reactor_t* reactor_create() {
+    reactor_t* reactor = calloc(1, sizeof(*reactor));
+    if(reactor == NULL) return NULL;
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(reactor->epfd == -1 || reactor->wake_fd == -1) {
+        if(reactor->epfd != -1) close(reactor->epfd);
+        if(reactor->wake_fd != -1) close(reactor->wake_fd);
+        free(reactor);
+        return NULL;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wake_fd, &event);
+
+    reactor->timers_lock = LOCK_INITIALIZER;
+    reactor->timers_capacity = REACTOR_TIMERS;
+    reactor->timers = malloc(sizeof(*reactor->timers) * reactor->timers_capacity);
+
+    return reactor;
+}
+
+void reactor_destroy(reactor_t** reactor) {
+    if((*reactor)->running) {
+        (*reactor)->running = false;
+        eventfd_write((*reactor)->wake_fd, 1);
+        pthread_join((*reactor)->thread, NULL);
+    }
+    close((*reactor)->epfd);
+    close((*reactor)->wake_fd);
+    lock_destroy(&(*reactor)->timers_lock);
+    free((*reactor)->timers);
+    free(*reactor);
+    *reactor = NULL;
+}
+
+void reactor_setAffinity(reactor_t* reactor, const int* cpus, size_t count) {
+    CPU_ZERO(&reactor->cpus);
+    for(size_t i = 0; i < count; ++i) {
+        CPU_SET(cpus[i], &reactor->cpus);
+    }
+    reactor->pinned = (count > 0);
+}
+
+void reactor_setFlush(reactor_t* reactor, reactor_flush_cb_t cb, void* arg) {
+    reactor->flush = cb;
+    reactor->flush_arg = arg;
+}
+
+void reactor_dispach(reactor_t* reactor) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if(reactor->pinned) pthread_attr_setaffinity_np(&attr, sizeof(reactor->cpus), &reactor->cpus);
+    reactor->running = true;
+    pthread_create(&reactor->thread, &attr, reactor_entry, reactor);
+    pthread_attr_destroy(&attr);
+}
+
+int reactor_watch(reactor_t* reactor, reactor_watch_t* watch, int fd, uint32_t events, reactor_cb_t cb, void* arg) {
+    watch->fd = fd;
+    watch->cb = cb;
+    watch->arg = arg;
+
+    struct epoll_event event = {.events = events | EPOLLONESHOT, .data.ptr = watch};
+    return epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void reactor_unwatch(reactor_t* reactor, reactor_watch_t* watch) {
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+void reactor_timer_add(reactor_t* reactor, reactor_timer_t* timer, uint64_t deadline_ms, reactor_timer_cb_t cb, void* arg) {
+    timer->deadline_ms = deadline_ms;
+    timer->cb = cb;
+    timer->arg = arg;
+
+    lock(&reactor->timers_lock);
+    if(reactor->timers_count == reactor->timers_capacity) {
+        reactor->timers_capacity *= 2;
+        reactor->timers = realloc(reactor->timers, sizeof(*reactor->timers) * reactor->timers_capacity);
+    }
+    timer->index = reactor->timers_count++;
+    reactor->timers[timer->index] = timer;
+    reactor_timer_up(reactor, timer->index);
+    bool first = (timer->index == 0);
+    unlock(&reactor->timers_lock);
+
+    // The reactor might be sleeping until a later deadline
+    if(first) eventfd_write(reactor->wake_fd, 1);
+}
+
+bool reactor_timer_cancel(reactor_t* reactor, reactor_timer_t* timer) {
+    lock(&reactor->timers_lock);
+    bool queued = (timer->index != TIMER_NOT_QUEUED);
+    if(queued) reactor_timer_remove(reactor, timer);
+    unlock(&reactor->timers_lock);
+    return queued;
+}
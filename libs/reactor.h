@@ -0,0 +1,57 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_READ    EPOLLIN
+#define REACTOR_WRITE   EPOLLOUT
+
+typedef struct reactor_t reactor_t;
+typedef void (*reactor_cb_t)(void*, uint32_t);
+typedef void (*reactor_timer_cb_t)(void*);
+typedef bool (*reactor_flush_cb_t)(void*);
+
+// Owned by the caller and must stay valid until the callback is executed
+typedef struct reactor_watch_t {
+    int fd;
+    reactor_cb_t cb;
+    void* arg;
+} reactor_watch_t;
+
+// Owned by the caller and must stay valid until the timer expires or is canceled
+typedef struct reactor_timer_t {
+    uint64_t deadline_ms;
+    size_t index;
+    reactor_timer_cb_t cb;
+    void* arg;
+} reactor_timer_t;
+
+uint64_t reactor_now_ms();
+
+reactor_t* reactor_create();
+
+void reactor_destroy(reactor_t** reactor);
+
+void reactor_setAffinity(reactor_t* reactor, const int* cpus, size_t count);
+
+// Called by the reactor thread after handling all the events and timers of a wakeup,
+// lets callbacks defer their work and dispatch it in one go. Returns true while it still holds
+// work back, the reactor then calls it again within a millisecond even with nothing to wake for
+void reactor_setFlush(reactor_t* reactor, reactor_flush_cb_t cb, void* arg);
+
+void reactor_dispach(reactor_t* reactor);
+
+int reactor_watch(reactor_t* reactor, reactor_watch_t* watch, int fd, uint32_t events, reactor_cb_t cb, void* arg);
+
+// Drops a watch before it fires, only safe from reactor callbacks since the reactor thread
+// could otherwise have fetched its event already
+void reactor_unwatch(reactor_t* reactor, reactor_watch_t* watch);
+
+void reactor_timer_add(reactor_t* reactor, reactor_timer_t* timer, uint64_t deadline_ms, reactor_timer_cb_t cb, void* arg);
+
+bool reactor_timer_cancel(reactor_t* reactor, reactor_timer_t* timer);
+
+#endif
@@ -1,5 +1,9 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <sys/sysinfo.h>
 #include <lock.h>
 #include <queue.h>
@@ -7,30 +11,208 @@
 
 #include <stdio.h>
 
+typedef struct threadPoolWorker_t {
+    threadPool_t* pool;
+    pthread_t thread;
+    bool alive;
+    // Waiting for work, owned by the pool lock
+    bool idle;
+} threadPoolWorker_t;
+
 struct threadPool_t {
-    queue_t* workQueue;
+    queue_t* workQueues[THREADPOOL_PRIORITIES];
     queue_t* tasksQueue;
+    // Protects the counters bellow, work is only popped after being claimed here
+    lock_t lock;
+    signal_t signal;
+    size_t pending;
+    size_t waiting;
+    size_t ready[THREADPOOL_PRIORITIES];
+    size_t skipped[THREADPOOL_PRIORITIES];
     volatile bool running;
     task_t* tasks;
+    int* cpus;
+    size_t cpus_count;
+    // Live workers, a worker slot can be reused once its thread retired
     size_t threads_count;
-    pthread_t threads[1];
+    size_t min_threads;
+    size_t max_threads;
+    threadPoolWorker_t* workers;
+    // Elastic sizing, see threadPool_setElastic()
+    bool elastic;
+    uint64_t latency_ns;
+    int latency_ms;
+    int idle_ms;
+    uint64_t last_claim_ns;
+    size_t spawned;
+    size_t retired;
+    signal_t supervisor_signal;
+    pthread_t supervisor;
+    atomic_bool grow;
+    _Atomic uint64_t last_spawn_ns;
+    _Atomic uint64_t max_wait_ns;
 };
 
 struct task_t {
     void* (*func)(void*);
     void* arg;
+    uint64_t queued_ns;
 };
 
+// Entries taken from the tasks queue per lock acquisition when pushing a batch
+#define THREADPOOL_PUSH_CHUNK   32
+
+static size_t threadPool_pickPriority(threadPool_t* pool) {
+    size_t priority = THREADPOOL_PRIORITIES;
+    // A class that was passed over too many times goes first so it can not starve
+    for(size_t i = 0; i < THREADPOOL_PRIORITIES; ++i) {
+        if(pool->ready[i] > 0 && pool->skipped[i] >= THREADPOOL_STARVATION_LIMIT) {
+            priority = i;
+            break;
+        }
+    }
+    if(priority == THREADPOOL_PRIORITIES) {
+        for(priority = 0; pool->ready[priority] == 0; ++priority);
+    }
+    for(size_t i = priority + 1; i < THREADPOOL_PRIORITIES; ++i) {
+        if(pool->ready[i] > 0) pool->skipped[i] += 1;
+    }
+    pool->skipped[priority] = 0;
+    return priority;
+}
+
+static uint64_t threadPool_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+// Returns true if the worker has been idle long enough to leave, only called in elastic mode
+static bool threadPool_idleWait(threadPool_t* pool, uint64_t idle_since) {
+    if(pool->threads_count <= pool->min_threads) {
+        lock_wait(&pool->lock, &pool->signal);
+        return false;
+    }
+    lock_timedwait(&pool->lock, &pool->signal, pool->idle_ms);
+    return (pool->running && pool->pending == 0 && pool->threads_count > pool->min_threads &&
+            threadPool_now_ns() - idle_since >= (uint64_t)pool->idle_ms * 1000000);
+}
+
+static void threadPool_claimed(threadPool_t* pool, task_t* task) {
+    uint64_t wait = threadPool_now_ns() - task->queued_ns;
+    uint64_t max = atomic_load(&pool->max_wait_ns);
+    while(wait > max && !atomic_compare_exchange_weak(&pool->max_wait_ns, &max, wait));
+    // Work is waiting longer than we want, let the supervisor add a thread. Work queued before
+    // the last spawn is the backlog that thread was added for and must not ask for another one
+    if(wait > pool->latency_ns && task->queued_ns > atomic_load(&pool->last_spawn_ns)) atomic_store(&pool->grow, true);
+}
+
+static size_t threadPool_getWork(threadPool_t* pool, threadPoolWorker_t* worker, task_t** tasks) {
+    lock(&pool->lock);
+    pool->waiting += 1;
+    worker->idle = true;
+    uint64_t idle_since = (pool->elastic ? threadPool_now_ns() : 0);
+    while(pool->running && pool->pending == 0) {
+        if(!pool->elastic) lock_wait(&pool->lock, &pool->signal);
+        else if(threadPool_idleWait(pool, idle_since)) {
+            // Retire, the slot can be taken by a new worker right away
+            pool->waiting -= 1;
+            worker->idle = false;
+            pool->threads_count -= 1;
+            pool->retired += 1;
+            worker->alive = false;
+            unlock(&pool->lock);
+            pthread_detach(pthread_self());
+            return 0;
+        }
+    }
+    pool->waiting -= 1;
+    worker->idle = false;
+    if(!pool->running) {
+        unlock(&pool->lock);
+        return 0;
+    }
+    size_t priority = threadPool_pickPriority(pool);
+    size_t count = 1;
+    if(priority >= THREADPOOL_BATCH_PRIORITY) {
+        // Only take our share, the threads still idle get the rest
+        count = (pool->ready[priority] + pool->waiting) / (pool->waiting + 1);
+        if(count > THREADPOOL_BATCH) count = THREADPOOL_BATCH;
+    }
+    pool->ready[priority] -= count;
+    pool->pending -= count;
+    if(pool->elastic) pool->last_claim_ns = threadPool_now_ns();
+    unlock(&pool->lock);
+    // The work was pushed before being accounted so it has to be there
+    count = pop_many(pool->workQueues[priority], (void**)tasks, count);
+    if(pool->elastic && count > 0) threadPool_claimed(pool, tasks[0]);
+    return count;
+}
+
 static void* thread_entry(void* arg) {
-    threadPool_t* pool = (threadPool_t*)arg;
-    task_t* task = NULL;
+    threadPoolWorker_t* worker = (threadPoolWorker_t*)arg;
+    threadPool_t* pool = worker->pool;
+    task_t* tasks[THREADPOOL_BATCH];
+    task_t work[THREADPOOL_BATCH];
+    size_t count;
 
     while(pool->running) {
-        if((task = pop(pool->workQueue)) == NULL) break;
-        (void)task->func(task->arg);
-        memset(task, 0, sizeof(*task));
-        if(pool->running) push(pool->tasksQueue, task);
+        if((count = threadPool_getWork(pool, worker, tasks)) == 0) break;
+        // Hand the entries back before running so producers are not held by our batch
+        for(size_t i = 0; i < count; ++i) {
+            work[i] = *tasks[i];
+            memset(tasks[i], 0, sizeof(*tasks[i]));
+        }
+        if(pool->running) push_many(pool->tasksQueue, (void**)tasks, count);
+        for(size_t i = 0; i < count; ++i) {
+            (void)work[i].func(work[i].arg);
+        }
+    }
+    return NULL;
+}
+
+// Called with the pool lock held
+static bool threadPool_spawn(threadPool_t* pool) {
+    size_t i;
+    for(i = 0; i < pool->max_threads && pool->workers[i].alive; ++i);
+    if(i == pool->max_threads) return false;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if(pool->cpus_count > 0) {
+        // Each thread is pinned to a single cpu, the list is reused if there are more threads than cpus
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pool->cpus[i % pool->cpus_count], &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    pool->workers[i].pool = pool;
+    bool created = (pthread_create(&pool->workers[i].thread, &attr, thread_entry, &pool->workers[i]) == 0);
+    pthread_attr_destroy(&attr);
+    if(!created) return false;
+    pool->workers[i].alive = true;
+    pool->threads_count += 1;
+    return true;
+}
+
+static void* threadPool_supervise(void* arg) {
+    threadPool_t* pool = (threadPool_t*)arg;
+    lock(&pool->lock);
+    while(pool->running) {
+        lock_timedwait(&pool->lock, &pool->supervisor_signal, pool->latency_ms);
+        if(!pool->running) break;
+        // Work waiting without any claim for a whole latency target means every worker is busy or blocked
+        bool stalled = (pool->pending > 0 && threadPool_now_ns() - pool->last_claim_ns >= pool->latency_ns);
+        bool grow = atomic_exchange(&pool->grow, false);
+        // One thread per period so a burst does not spawn the whole range at once
+        if((stalled || grow) && pool->waiting == 0 && pool->threads_count < pool->max_threads) {
+            if(threadPool_spawn(pool)) {
+                pool->spawned += 1;
+                atomic_store(&pool->last_spawn_ns, threadPool_now_ns());
+            }
+        }
     }
+    unlock(&pool->lock);
     return NULL;
 }
 
@@ -38,17 +220,45 @@ static inline task_t* threadPool_getTask(threadPool_t* pool) {
     return pop(pool->tasksQueue);
 }
 
-static inline void threadPool_pushTask(threadPool_t* pool, task_t* task) {
-    push(pool->workQueue, task);
+static inline void threadPool_pushTask(threadPool_t* pool, size_t priority, task_t* task) {
+    if(pool->elastic) task->queued_ns = threadPool_now_ns();
+    push(pool->workQueues[priority], task);
+    lock(&pool->lock);
+    pool->ready[priority] += 1;
+    pool->pending += 1;
+    unlock_signal(&pool->lock, &pool->signal);
+}
+
+static inline void threadPool_pushTasks(threadPool_t* pool, size_t priority, task_t** tasks, size_t count) {
+    if(pool->elastic) {
+        uint64_t now = threadPool_now_ns();
+        for(size_t i = 0; i < count; ++i) tasks[i]->queued_ns = now;
+    }
+    push_many(pool->workQueues[priority], (void**)tasks, count);
+    lock(&pool->lock);
+    pool->ready[priority] += count;
+    pool->pending += count;
+    if(count > 1) {
+        signal_broacast(&pool->signal);
+        unlock(&pool->lock);
+    }
+    else unlock_signal(&pool->lock, &pool->signal);
 }
 
 threadPool_t* threadPool_create(size_t workqueue_size, size_t threads_count) {
     if(threads_count == 0) threads_count = (get_nprocs() - 1);
     if(workqueue_size == 0) workqueue_size = threads_count * 2;
-    threadPool_t* pool = calloc(1, sizeof(*pool) + (sizeof(pthread_t) * threads_count - sizeof(pthread_t)));
-    pool->workQueue = queue_create(workqueue_size);
+    threadPool_t* pool = calloc(1, sizeof(*pool));
+    for(size_t i = 0; i < THREADPOOL_PRIORITIES; ++i) {
+        pool->workQueues[i] = queue_create(workqueue_size);
+    }
     pool->tasksQueue = queue_create(workqueue_size);
-    pool->threads_count = threads_count;
+    pool->lock = LOCK_INITIALIZER;
+    // Idle elastic workers wait on it with a timeout, which needs the clock set by signal_init()
+    signal_init(&pool->signal);
+    pool->min_threads = threads_count;
+    pool->max_threads = threads_count;
+    pool->workers = calloc(threads_count, sizeof(*pool->workers));
 
     pool->tasks = calloc(workqueue_size, sizeof(*pool->tasks));
     int i = 0;
@@ -60,34 +270,155 @@ threadPool_t* threadPool_create(size_t workqueue_size, size_t threads_count) {
 }
 
 void threadPool_destroy(threadPool_t** pool, bool force) {
+    // Waiters check the flag under the lock before waiting again, one broadcast lets all of them leave
+    lock(&(*pool)->lock);
+    bool supervised = ((*pool)->running && (*pool)->elastic);
     (*pool)->running = false;
+    signal_broacast(&(*pool)->signal);
+    unlock(&(*pool)->lock);
 
-    queue_destroy(&(*pool)->tasksQueue);
-    queue_destroy(&(*pool)->workQueue);
+    // No worker can be spawned once the supervisor is gone
+    if(supervised) {
+        lock(&(*pool)->lock);
+        unlock_signal(&(*pool)->lock, &(*pool)->supervisor_signal);
+        pthread_join((*pool)->supervisor, NULL);
+    }
 
+    // Only the busy workers are canceled, a waiting one could be canceled in its wait and leave holding the pool lock.
+    // A busy one never waits again since it finds the pool stopped
     if(force) {
-        int i;
-        for(i = 0; i < (*pool)->threads_count; ++i) {
-            pthread_cancel((*pool)->threads[i]);
-            pthread_join((*pool)->threads[i], NULL);
+        lock(&(*pool)->lock);
+        for(size_t i = 0; i < (*pool)->max_threads; ++i) {
+            if((*pool)->workers[i].alive && !(*pool)->workers[i].idle) pthread_cancel((*pool)->workers[i].thread);
         }
+        unlock(&(*pool)->lock);
     }
+
+    // Without force the busy workers finish what they run and leave, the pool is only released after them
+    for(size_t i = 0; i < (*pool)->max_threads; ++i) {
+        if((*pool)->workers[i].alive) pthread_join((*pool)->workers[i].thread, NULL);
+    }
+
+    queue_destroy(&(*pool)->tasksQueue);
+    for(size_t i = 0; i < THREADPOOL_PRIORITIES; ++i) {
+        queue_destroy(&(*pool)->workQueues[i]);
+    }
+    lock_destroy(&(*pool)->lock);
+    signal_destroy(&(*pool)->signal);
+    signal_destroy(&(*pool)->supervisor_signal);
+    free((*pool)->workers);
+    free((*pool)->cpus);
     free((*pool)->tasks);
     free((*pool));
     *pool = NULL;
 }
 
+void threadPool_setAffinity(threadPool_t* pool, const int* cpus, size_t count) {
+    free(pool->cpus);
+    pool->cpus = NULL;
+    pool->cpus_count = 0;
+    if(cpus == NULL || count == 0) return;
+    pool->cpus = malloc(sizeof(*pool->cpus) * count);
+    memcpy(pool->cpus, cpus, sizeof(*pool->cpus) * count);
+    pool->cpus_count = count;
+}
+
+void threadPool_setElastic(threadPool_t* pool, size_t min_threads, size_t max_threads, int latency_ms, int idle_ms) {
+    if(pool->running) return;
+    if(min_threads == 0) min_threads = 1;
+    if(max_threads < min_threads) max_threads = min_threads;
+    free(pool->workers);
+    pool->workers = calloc(max_threads, sizeof(*pool->workers));
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->latency_ms = ((latency_ms > 0) ? latency_ms : THREADPOOL_DEFAULT_LATENCY_MS);
+    pool->latency_ns = (uint64_t)pool->latency_ms * 1000000;
+    pool->idle_ms = ((idle_ms > 0) ? idle_ms : THREADPOOL_DEFAULT_IDLE_MS);
+    signal_init(&pool->supervisor_signal);
+    pool->elastic = true;
+}
+
+void threadPool_getStats(threadPool_t* pool, threadPoolStats_t* stats) {
+    lock(&pool->lock);
+    stats->threads = pool->threads_count;
+    stats->idle = pool->waiting;
+    stats->pending = pool->pending;
+    stats->min_threads = pool->min_threads;
+    stats->max_threads = pool->max_threads;
+    stats->spawned = pool->spawned;
+    stats->retired = pool->retired;
+    unlock(&pool->lock);
+    // Longest wait since the last read
+    stats->max_wait_us = atomic_exchange(&pool->max_wait_ns, 0) / 1000;
+}
+
 void threadPool_dispach(threadPool_t* pool) {
-    int i = 0;
+    lock(&pool->lock);
     pool->running = true;
-    for(; i < pool->threads_count; ++i) {
-        pthread_create(&pool->threads[i], NULL, thread_entry, pool);
+    pool->last_claim_ns = threadPool_now_ns();
+    for(size_t i = 0; i < pool->min_threads; ++i) {
+        threadPool_spawn(pool);
     }
+    if(pool->elastic) pthread_create(&pool->supervisor, NULL, threadPool_supervise, pool);
+    unlock(&pool->lock);
 }
 
 void threadPool_pushWork(threadPool_t* pool, void* (*work)(void*), void* arg) {
+    threadPool_pushWorkPriority(pool, THREADPOOL_DEFAULT_PRIORITY, work, arg);
+}
+
+void threadPool_pushWorkPriority(threadPool_t* pool, size_t priority, void* (*work)(void*), void* arg) {
+    if(priority >= THREADPOOL_PRIORITIES) priority = THREADPOOL_PRIORITIES - 1;
     task_t* task = threadPool_getTask(pool);
     task->func = work;
     task->arg = arg;
-    threadPool_pushTask(pool, task);
+    threadPool_pushTask(pool, priority, task);
+}
+
+bool threadPool_tryPushWorkPriority(threadPool_t* pool, size_t priority, void* (*work)(void*), void* arg) {
+    if(priority >= THREADPOOL_PRIORITIES) priority = THREADPOOL_PRIORITIES - 1;
+    task_t* task = try_pop(pool->tasksQueue);
+    if(task == NULL) return false;
+    task->func = work;
+    task->arg = arg;
+    threadPool_pushTask(pool, priority, task);
+    return true;
+}
+
+void threadPool_pushWorkBatch(threadPool_t* pool, size_t priority, void* (*work)(void*), void** args, size_t count) {
+    if(priority >= THREADPOOL_PRIORITIES) priority = THREADPOOL_PRIORITIES - 1;
+    task_t* tasks[THREADPOOL_PUSH_CHUNK];
+    size_t done = 0;
+    while(done < count) {
+        size_t chunk = count - done;
+        if(chunk > THREADPOOL_PUSH_CHUNK) chunk = THREADPOOL_PUSH_CHUNK;
+        // Blocks until at least one entry is free, we might get less than we asked for
+        size_t n = pop_many(pool->tasksQueue, (void**)tasks, chunk);
+        if(n == 0) return;
+        for(size_t i = 0; i < n; ++i) {
+            tasks[i]->func = work;
+            tasks[i]->arg = args[done + i];
+        }
+        threadPool_pushTasks(pool, priority, tasks, n);
+        done += n;
+    }
+}
+
+size_t threadPool_tryPushWorkBatch(threadPool_t* pool, size_t priority, void* (*work)(void*), void** args, size_t count) {
+    if(priority >= THREADPOOL_PRIORITIES) priority = THREADPOOL_PRIORITIES - 1;
+    task_t* tasks[THREADPOOL_PUSH_CHUNK];
+    size_t done = 0;
+    while(done < count) {
+        size_t chunk = count - done;
+        if(chunk > THREADPOOL_PUSH_CHUNK) chunk = THREADPOOL_PUSH_CHUNK;
+        size_t n = try_pop_many(pool->tasksQueue, (void**)tasks, chunk);
+        if(n == 0) break;
+        for(size_t i = 0; i < n; ++i) {
+            tasks[i]->func = work;
+            tasks[i]->arg = args[done + i];
+        }
+        threadPool_pushTasks(pool, priority, tasks, n);
+        done += n;
+    }
+    return done;
 }
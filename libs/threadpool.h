@@ -1,17 +1,63 @@
 #ifndef _THREADPOOL_H_
 #define _THREADPOOL_H_
 
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+// Priority 0 is the most urgent
+#define THREADPOOL_PRIORITIES           3
+#define THREADPOOL_DEFAULT_PRIORITY     1
+// Times a class with pending work can be passed over before it is served
+#define THREADPOOL_STARVATION_LIMIT     8
+// Work of this class and less urgent ones is taken up to THREADPOOL_BATCH at a time when there
+// are no idle threads. More urgent classes are always taken one by one since they can hold a thread
+#define THREADPOOL_BATCH_PRIORITY       1
+#define THREADPOOL_BATCH                4
+// Elastic mode defaults, see threadPool_setElastic()
+#define THREADPOOL_DEFAULT_LATENCY_MS   20
+#define THREADPOOL_DEFAULT_IDLE_MS      5000
 
 typedef struct threadPool_t threadPool_t;
 typedef struct task_t task_t;
 
+typedef struct threadPoolStats_t {
+    size_t threads;         // Live workers
+    size_t idle;            // Workers waiting for work
+    size_t pending;         // Work queued and not claimed yet
+    size_t min_threads;
+    size_t max_threads;
+    size_t spawned;         // Workers added by the elastic mode
+    size_t retired;         // Workers that left after being idle
+    uint64_t max_wait_us;   // Longest time a work waited to be claimed since the last read, elastic mode only
+} threadPoolStats_t;
+
 threadPool_t* threadPool_create(size_t workqueue_size, size_t threads_count);
 
+// Workers are always joined before the pool is released. Force cancels the busy ones, otherwise they finish the work
+// they are running. Work that was queued and not claimed yet is dropped either way
 void threadPool_destroy(threadPool_t** pool, bool force);
 
+void threadPool_setAffinity(threadPool_t* pool, const int* cpus, size_t count);
+
+// Must be called before dispatching. The pool starts with min_threads, adds one thread per latency
+// period while work waits longer than latency_ms with no idle thread, and retires threads idle for idle_ms
+void threadPool_setElastic(threadPool_t* pool, size_t min_threads, size_t max_threads, int latency_ms, int idle_ms);
+
+void threadPool_getStats(threadPool_t* pool, threadPoolStats_t* stats);
+
 void threadPool_dispach(threadPool_t* pool);
 
 void threadPool_pushWork(threadPool_t* pool, void* (*work)(void*), void* arg);
 
-#endif
\ No newline at end of file
+void threadPool_pushWorkPriority(threadPool_t* pool, size_t priority, void* (*work)(void*), void* arg);
+
+// Non blocking variants, they only use free task entries and report how much work was accepted
+bool threadPool_tryPushWorkPriority(threadPool_t* pool, size_t priority, void* (*work)(void*), void* arg);
+
+size_t threadPool_tryPushWorkBatch(threadPool_t* pool, size_t priority, void* (*work)(void*), void** args, size_t count);
+
+// Pushes the same work once for each argument, taking the pool locks once per chunk instead of per work
+void threadPool_pushWorkBatch(threadPool_t* pool, size_t priority, void* (*work)(void*), void** args, size_t count);
+
+#endif
@@ -11,10 +11,11 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <openssl/ssl.h>
 #include <async.h>
-#include <queue.h>
 #include <lock.h>
+#include <epoch.h>
 
 // NOTE: we are not expanding the arrays that store open connections we might want to change this in the future
 // NOTE: we are not preventing a connection from misbehaving (send huge data blocks or spamming requests)
@@ -24,6 +25,28 @@
 #define DEFAULT_BUFFER_SIZE     (4096)
 //#define MAX_REQUEST_SIZE        (DEFAULT_BUFFER_SIZE * 16)
 #define STR_LEN(str)   (sizeof(str) - 1)
+// Marks a closed connection that can only be released once its request task is done
+#define CLOSING_FD              (-2)
+#define REQUEST_ABORTED         ((size_t)-1)
+// Poll period used while there are deferred requests waiting for a task
+#define DEFER_RETRY_MS          10
+// Poll slots, connections use the ones after the listening socket and the listener wake up
+#define LISTEN_SLOT             0
+#define WAKE_SLOT               1
+#define FIRST_CONNECTION        2
+
+// Connection states, they also tell who owns the input buffer
+#define CON_IDLE                0   // No task, the listener reads into the buffer
+#define CON_READING             1   // The task waits for more data, the listener reads into the buffer
+#define CON_PROCESSING          2   // The task owns the buffer
+#define CON_WRITING             3   // The task is sending the response
+#define CON_STATE_MASK          3
+// Flags, closed is set by the listener and the task gives up on its next transition.
+// Parked is set when data arrived while the task owned the buffer and the listener stopped polling
+#define CON_CLOSED              4
+#define CON_PARKED              8
+// Set by a task whose request ran out of time, the listener answers 408 and closes the connection
+#define CON_EXPIRED             16
 
 static const struct HTTP_RESPONSES
 {
@@ -46,6 +69,7 @@ static const struct HTTP_RESPONSES
     {.code = 404, .reason = "Not Found"},
     {.code = 405, .reason = "Method Not Allowed"},
     {.code = 408, .reason = "Request Timeout"},
+    {.code = 503, .reason = "Service Unavailable"},
 };
 
 typedef struct pathname_t pathname_t;
@@ -56,21 +80,34 @@ struct pathname_t {
     void (*patch)(http_request_t*, http_response_t*);
     void (*delete)(http_request_t*, http_response_t*);
 
-    size_t paths_count;
-    pathname_t** paths;
+    // Children are replaced as a whole, the array is published before the count
+    _Atomic size_t paths_count;
+    _Atomic(pathname_t**) paths;
 
     size_t len;
     char path[1];
 };
 
+typedef struct rcv_data_t {
+    size_t size;
+    size_t bytes_received;
+    char* payload;
+} rcv_data_t;
+
 typedef struct connection_t {
     int fd;
     SSL* ssl;
     int timeout;
-    // Other flags and data
-    lock_t lock;
-    bool running;
-    queue_t* requests;
+    http_server_t* server;
+    atomic_uint state;
+    // Signaled every time data is handed to a task waiting in the reading state
+    int notify_fd;
+    // Triggered when the listener closes the connection under its request task
+    asyncCancel_t* cancel;
+    // Always NUL terminated, bytes past the current request belong to the next one
+    rcv_data_t in;
+    // Only used by the request task
+    http_con_cache_t cache;
 }connection_t;
 
 struct http_server_t {
@@ -92,24 +129,20 @@ struct http_server_t {
     nfds_t nfds;
     struct pollfd* pfds;
     connection_t* connections;
+    // Signaled by tasks handing a parked connection back
+    int wake_fd;
     
+    int overload;
+    int retry_after;
+    int request_timeout;
+
     atomic_bool active;
     asyncTask_t* listener;
     pathname_t* root;
+    // Serializes route registration, requests resolve paths in an epoch
+    lock_t routes_lock;
 };
 
-typedef struct rcv_data_t {
-    size_t size;
-    size_t bytes_received;
-    char* payload;
-} rcv_data_t;
-
-typedef struct request_t {
-    connection_t* con;
-    http_server_t* server;
-    rcv_data_t* data;
-} request_t;
-
 
 /************************** PRIVATE METHODS **************************/
 
@@ -156,9 +189,15 @@ static pathname_t* http_create_url_path(const char* base_path, const size_t len)
 
 static void http_add_child_path(pathname_t* base_path, pathname_t* child_path)
 {
-    base_path->paths_count += 1;
-    base_path->paths = (pathname_t**)realloc(base_path->paths, sizeof(pathname_t*) * base_path->paths_count);
-    base_path->paths[base_path->paths_count - 1] = child_path;
+    // Requests might be walking the old array so it is only released after their epoch
+    size_t count = atomic_load(&base_path->paths_count);
+    pathname_t** old_paths = atomic_load(&base_path->paths);
+    pathname_t** paths = (pathname_t**)malloc(sizeof(pathname_t*) * (count + 1));
+    if(count > 0) memcpy(paths, old_paths, sizeof(pathname_t*) * count);
+    paths[count] = child_path;
+    atomic_store(&base_path->paths, paths);
+    atomic_store(&base_path->paths_count, count + 1);
+    epoch_retire(old_paths, NULL);
 }
 
 static pathname_t* http_resolve_path(pathname_t* base_path, const char* path, const size_t len, char** remaining)
@@ -177,14 +216,16 @@ static pathname_t* http_resolve_path(pathname_t* base_path, const char* path, co
         if((len - pos) == 0) return current_path;
 
         // No more paths to check
-        if(current_path->paths_count == 0) break;
+        size_t paths_count = atomic_load(&current_path->paths_count);
+        if(paths_count == 0) break;
+        pathname_t** paths = atomic_load(&current_path->paths);
         
         // If no path is matched we break the loop
         search = false;
 
-        for(size_t child = 0; child < current_path->paths_count; ++child)
+        for(size_t child = 0; child < paths_count; ++child)
         {
-            pathname_t* temp = current_path->paths[child];
+            pathname_t* temp = paths[child];
             if(temp->len > (len - pos)) continue;
             
             if(temp->len < (len - pos))
@@ -218,9 +259,13 @@ static bool http_open_connection(connection_t* connection, int fd, int timeout,
         connection->fd = fd;
         connection->timeout = (10 * 1000) / timeout;
         connection->ssl = ssl;
-        connection->requests = queue_create(10);
-        connection->lock = LOCK_INITIALIZER;
-        connection->running = false;
+        connection->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        connection->cancel = async_cancel_create();
+        connection->in.size = DEFAULT_BUFFER_SIZE;
+        connection->in.bytes_received = 0;
+        connection->in.payload = malloc(DEFAULT_BUFFER_SIZE);
+        memset(&connection->cache, 0, sizeof(connection->cache));
+        atomic_store(&connection->state, CON_IDLE);
         return true;
     }
     else {
@@ -237,83 +282,131 @@ static void http_close_connection(connection_t* connection) {
     SSL_shutdown(connection->ssl);
     SSL_free(connection->ssl);
     connection->ssl = NULL;
-    queue_destroy(&connection->requests);
-    lock_destroy(&connection->lock);
+    close(connection->notify_fd);
+    connection->notify_fd = -1;
+    async_cancel_release(&connection->cancel);
+    free(connection->in.payload);
+    connection->in.payload = NULL;
 }
 
-static size_t http_get_request_header(request_t* request) {
-    // We will first assume that we already received everything
-    bool is_header_completed = false;
-    size_t header_end = 0;
+static inline bool http_con_readable(unsigned state) {
+    return ((state & CON_STATE_MASK) == CON_IDLE || (state & CON_STATE_MASK) == CON_READING);
+}
 
-    while(is_header_completed == false) {
-        // Check if we received the complete header
-        if(request->data->payload[request->data->bytes_received - 4] == '\r' &&
-           request->data->payload[request->data->bytes_received - 3] == '\n' &&
-           request->data->payload[request->data->bytes_received - 2] == '\r' &&
-           request->data->payload[request->data->bytes_received - 1] == '\n')
-        {
-            is_header_completed = true;
-            header_end = request->data->bytes_received;
+// Moves a connection owned by its task to a new state, fails once the listener closed it.
+// After entering the idle state the task must not touch the connection anymore
+static bool http_con_enter(connection_t* con, unsigned state) {
+    unsigned old = atomic_load(&con->state);
+    unsigned new;
+    do {
+        if(old & CON_CLOSED) return false;
+        // Only handing the buffer back lets the listener poll the connection again
+        new = (http_con_readable(state) ? state : (state | (old & CON_PARKED)));
+    } while(!atomic_compare_exchange_weak(&con->state, &old, new));
+
+    if((old & CON_PARKED) && http_con_readable(state)) eventfd_write(con->server->wake_fd, 1);
+    return true;
+}
+
+static void http_drop_connection(http_server_t* this, nfds_t i) {
+    connection_t* con = &this->connections[(int)i];
+    unsigned old = atomic_fetch_or(&con->state, CON_CLOSED);
+
+    if((old & CON_STATE_MASK) != CON_IDLE) {
+        // The request task still uses the connection, wake it up so it can give up on it
+        async_cancel(con->cancel);
+        this->pfds[i].fd = CLOSING_FD;
+        return;
+    }
+    http_close_connection(con);
+    this->pfds[i].fd = -1;
+    if(i == this->nfds - 1) this->nfds -= 1;
+}
+
+static void http_reap_connections(http_server_t* this) {
+    for(nfds_t i = FIRST_CONNECTION; i < this->nfds; i++) {
+        if(this->pfds[i].fd != CLOSING_FD) continue;
+        if(atomic_load(&this->connections[(int)i].state) == CON_CLOSED) http_drop_connection(this, i);
+    }
+}
+
+// Appends everything the connection has to its buffer, only called in the idle and reading states
+static bool http_read_connection(connection_t* con) {
+    rcv_data_t* data = &con->in;
+    do {
+        // Always keep room for the terminator
+        if(data->size - data->bytes_received <= 1) {
+            data->size *= 2;
+            data->payload = realloc(data->payload, data->size);
         }
-        else {
-            char* hdr_end = strstr(request->data->payload, "\r\n\r\n");
-            if(hdr_end) {
-                is_header_completed = true;
-                header_end = ((hdr_end + 4) - request->data->payload);
+        // bytes_received is unsigned so we can not use it to catch SSL_read errors
+        int received = SSL_read(con->ssl, data->payload + data->bytes_received, data->size - data->bytes_received - 1);
+        if(received <= 0) return false;
+        data->bytes_received += received;
+    } while(SSL_pending(con->ssl) > 0);
+    data->payload[data->bytes_received] = 0;
+    return true;
+}
+
+static bool http_wait_request_data(asyncTask_t* self, connection_t* con) {
+    // Hand the buffer back to the listener until it appended more data
+    if(!http_con_enter(con, CON_READING)) return false;
+    while(true) {
+        unsigned state = atomic_load(&con->state);
+        if(state & CON_CLOSED) return false;
+        if((state & CON_STATE_MASK) == CON_PROCESSING) return true;
+        // Suspend instead of blocking so slow clients do not hold a thread
+        EAsync_t status = await_readable(self, con->notify_fd);
+        if(status == EAsync_Cancelled) return false;
+        if(status == EAsync_Timeout) {
+            // Only the listener uses the connection while we wait, it answers and closes it
+            async_set_deadline(self, 0);
+            unsigned old = atomic_load(&con->state);
+            while((old & (CON_STATE_MASK | CON_CLOSED)) == CON_READING) {
+                if(atomic_compare_exchange_weak(&con->state, &old, old | CON_EXPIRED)) {
+                    eventfd_write(con->server->wake_fd, 1);
+                    break;
+                }
             }
+            continue;
         }
-
-        if(is_header_completed == false) {
-            // TODO: why not get the next package and use it's size to update the payload size?
-            request->data->size *= 2;
-            request->data->payload = realloc(request->data->payload, request->data->size);
-            // Get more data
-            rcv_data_t* data = pop(request->con->requests);
-            memcpy(request->data->payload + request->data->bytes_received, data->payload, data->bytes_received);
-            request->data->bytes_received += data->bytes_received;
-            free(data->payload);
-            free(data);
+        if(status != EAsync_Success) {
+            async_sleep(self, DEFER_RETRY_MS);
+            continue;
         }
+        eventfd_t count;
+        (void)eventfd_read(con->notify_fd, &count);
     }
-    return header_end;
 }
 
-static size_t http_get_request_body(request_t* request, size_t header_end) {
+static size_t http_get_request_header(asyncTask_t* self, connection_t* con) {
+    while(true) {
+        // Check if we received the complete header, the buffer can hold pipelined requests so the first end counts
+        char* hdr_end = strstr(con->in.payload, "\r\n\r\n");
+        if(hdr_end) return ((hdr_end + 4) - con->in.payload);
+
+        // Get more data
+        if(!http_wait_request_data(self, con)) return REQUEST_ABORTED;
+    }
+}
+
+static size_t http_get_request_body(asyncTask_t* self, connection_t* con, size_t header_end) {
     // We know that we have the complete header but do we have the complete request?
-    char* temp = strstr(request->data->payload, "Content-Length: ");
-    if(temp == NULL) return 0;
+    char* temp = strstr(con->in.payload, "Content-Length: ");
+    if(temp == NULL || (size_t)(temp - con->in.payload) >= header_end) return 0;
 
     size_t content_len = atoi(temp + STR_LEN("Content-Length: "));
 
-    if(request->data->bytes_received == (header_end + content_len)) {
-        if(request->data->bytes_received == request->data->size) {
-            // This is a shit we will have to realloc because of 1 byte
-            request->data->size += 1;
-            request->data->payload = realloc(request->data->payload, request->data->size);
-        }
-        request->data->payload[header_end + content_len] = 0;
-        return content_len;
-    }
-
-    request->data->size = header_end + content_len + 1;
-    request->data->payload = realloc(request->data->payload, request->data->size);
     // Get more data
-    while(request->data->bytes_received < (request->data->size - 1)) {
-        printf("http_get_request_body: untested!!!!\n");
-        rcv_data_t* data = pop(request->con->requests);
-        memcpy(request->data->payload + request->data->bytes_received, data->payload, data->bytes_received);
-        request->data->bytes_received += data->bytes_received;
-        free(data->payload);
-        free(data);
+    while(con->in.bytes_received < (header_end + content_len)) {
+        if(!http_wait_request_data(self, con)) return REQUEST_ABORTED;
     }
-    request->data->payload[header_end + content_len] = 0;
     return content_len;
 }
 
-static void http_parse_header(http_request_t* out_request, request_t* in_request) {
+static void http_parse_header(http_request_t* out_request, connection_t* con) {
     char* temp = NULL;
-    out_request->method = strtok_r(in_request->data->payload, " ", &temp);
+    out_request->method = strtok_r(con->in.payload, " ", &temp);
     out_request->url = strtok_r(NULL, " ", &temp);
     out_request->version = strtok_r(NULL, " \r\n", &temp);
     out_request->raw = out_request->version + strlen(out_request->version) + 1;
@@ -328,18 +421,32 @@ static void http_parse_header(http_request_t* out_request, request_t* in_request
     }
 }
 
-static void http_process_request(asyncTask_t* self, request_t* in_request) {
+static void http_process_request(asyncTask_t* self, connection_t* con) {
+    rcv_data_t* data = &con->in;
+    async_set_cancel(self, con->cancel);
     while(true) {
-        size_t header_end = http_get_request_header(in_request);
-        (void)http_get_request_body(in_request, header_end);
+        async_set_deadline(self, con->server->request_timeout);
+        size_t header_end = http_get_request_header(self, con);
+        size_t content_len = ((header_end == REQUEST_ABORTED) ? REQUEST_ABORTED : http_get_request_body(self, con, header_end));
+        // Connection was closed before the complete request arrived
+        if(content_len == REQUEST_ABORTED) break;
+
+        // Terminate the body, the byte we overwrite might be the start of a pipelined request
+        size_t request_end = header_end + content_len;
+        char next = data->payload[request_end];
+        data->payload[request_end] = 0;
 
         http_request_t request = {0};
-        http_parse_header(&request, in_request);
-        request.body = &in_request->data->payload[header_end];
+        http_parse_header(&request, con);
+        request.body = &data->payload[header_end];
+        request.cache = &con->cache;
 
         // Resolve path and get url suffix if there is one
-        pathname_t* root = in_request->server->root;
+        // Nodes are never released while serving, only the children arrays are replaced
+        pathname_t* root = con->server->root;
+        epoch_enter();
         pathname_t* path = http_resolve_path(root, request.url, strlen(request.url), (char**)&request.url_suffix);
+        epoch_exit();
 
         // We will always have a path if it's invalid the method function will have to return the error
         http_response_t response = {0};
@@ -410,108 +517,198 @@ static void http_process_request(asyncTask_t* self, request_t* in_request) {
             (response.header_buf ? response.header_buf : ""),
             response.payload_size
         );
-        if (SSL_write(in_request->con->ssl, reply, len) > 0 && response.payload_size > 0)
-            SSL_write(in_request->con->ssl, response.payload, response.payload_size);
-    
-        // If there is work to be done we continue otherwise we signal that this task is no longer available
-        bool pending = false;
-        lock(&in_request->con->lock);
-        if(empty(in_request->con->requests)) {
-            in_request->con->running = false;
-        }
-        else pending = true;
-        unlock(&in_request->con->lock);
+        bool open = http_con_enter(con, CON_WRITING);
+        if (open && SSL_write(con->ssl, reply, len) > 0 && response.payload_size > 0)
+            SSL_write(con->ssl, response.payload, response.payload_size);
 
         free(response.header_buf);
         if(response.clean_payload) free(response.payload);
         free(reply);
-        free(in_request->data->payload);
+        if(!open) break;
+
+        // Keep whatever was received after this request, it is the start of the next one
+        data->payload[request_end] = next;
+        data->bytes_received -= request_end;
+        memmove(data->payload, &data->payload[request_end], data->bytes_received + 1);
+        if(data->bytes_received > 0) {
+            if(!http_con_enter(con, CON_PROCESSING)) break;
+            continue;
+        }
+        if(data->size > DEFAULT_BUFFER_SIZE) {
+            data->size = DEFAULT_BUFFER_SIZE;
+            data->payload = realloc(data->payload, data->size);
+        }
+        // From here on the connection belongs to the listener again
+        if(http_con_enter(con, CON_IDLE)) return;
+        break;
+    }
+    // Closed by the listener, it releases the connection once we are out
+    atomic_store(&con->state, CON_CLOSED);
+}
+
+// Gives back a request that will never get a task, returns whether its connection was already closed
+static bool http_release_request(connection_t* con) {
+    // No task ever owned the connection so only the listener changed its state
+    bool closed = (atomic_load(&con->state) & CON_CLOSED);
+    con->in.bytes_received = 0;
+    atomic_store(&con->state, (closed ? CON_CLOSED : CON_IDLE));
+    return closed;
+}
+
+static void http_reject_request(http_server_t* this, connection_t* con) {
+    nfds_t i = (nfds_t)(con - this->connections);
+
+    bool closed = http_release_request(con);
+
+    // A closed connection is already waiting to be reaped
+    if(closed) return;
+    char reply[128];
+    int len = snprintf(reply, sizeof(reply), "HTTP/1.1 503 %s\r\nRetry-After: %d\r\nConnection: close\r\nContent-Length: 0\r\n\r\n",
+        HttpResponses[HTTP_503_SERVICE_UNAVAILABLE].reason, this->retry_after);
+    SSL_write(con->ssl, reply, len);
+    printf("Connection %d rejected, server overloaded\n", this->pfds[i].fd);
+    http_drop_connection(this, i);
+}
+
+static size_t http_start_requests(http_server_t* this, connection_t** starts, asyncTask_t** tasks, size_t count) {
+    if(count == 0) return 0;
+    // Once started a request belongs to its task, so only the ones left behind are touched afterwards
+    for(size_t i = 0; i < count; ++i) {
+        this->pfds[starts[i] - this->connections].events = POLLIN;
+    }
+    // Never block here, a saturated engine would stop accepts and reads for every connection
+    size_t started = async_try_many(AsyncPriorityRequest, (async_func_t)http_process_request, (void**)starts, tasks, count);
+    for(size_t i = 0; i < started; ++i) {
+        async_detach(&tasks[i]);
+    }
+    if(started == count) return 0;
+
+    if(this->overload == HTTP_OVERLOAD_REJECT) {
+        for(size_t i = started; i < count; ++i) http_reject_request(this, starts[i]);
+        return 0;
+    }
+    // Deferred connections are not read until their request starts, TCP pushes back on the client
+    size_t deferred = count - started;
+    for(size_t i = started; i < count; ++i) {
+        this->pfds[starts[i] - this->connections].events = 0;
+    }
+    memmove(starts, &starts[started], sizeof(*starts) * deferred);
+    return deferred;
+}
+
+// The task gave up waiting for the rest of the request, it only waits for the connection to be closed
+static void http_expire_connection(http_server_t* this, nfds_t i) {
+    connection_t* con = &this->connections[(int)i];
+    char reply[128];
+    int len = snprintf(reply, sizeof(reply), "HTTP/1.1 408 %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n",
+        HttpResponses[HTTP_408_REQUEST_TIMEOUT].reason);
+    SSL_write(con->ssl, reply, len);
+    printf("Connection %d request timeout\n", this->pfds[i].fd);
+    http_drop_connection(this, i);
+}
 
-        // If pending is set we have requests that need to be handled
-        if(!pending) break;
-        // Get more work an run again
-        in_request->data = pop(in_request->con->requests);
+// Connections parked while their task owned the buffer are polled again once it is handed back
+static void http_unpark_connections(http_server_t* this) {
+    eventfd_t count;
+    if(eventfd_read(this->wake_fd, &count) != 0) return;
+    for(nfds_t i = FIRST_CONNECTION; i < this->nfds; i++) {
+        if(this->pfds[i].fd < 0) continue;
+        unsigned state = atomic_load(&this->connections[(int)i].state);
+        if((state & (CON_EXPIRED | CON_CLOSED)) == CON_EXPIRED) {
+            http_expire_connection(this, i);
+            continue;
+        }
+        if(this->pfds[i].events != 0) continue;
+        if(http_con_readable(state)) this->pfds[i].events = POLLIN;
     }
-    free(in_request);
 }
 
 static void http_server_worker(asyncTask_t* self, http_server_t* this) {
-    request_t* request = malloc(sizeof(request_t));
-    request->data = malloc(sizeof(rcv_data_t));
-    request->data->payload = malloc(DEFAULT_BUFFER_SIZE);
-    request->data->size = DEFAULT_BUFFER_SIZE;
+    // Connections with a new request and no task, started together once the poll results are handled
+    connection_t** starts = malloc(sizeof(connection_t*) * this->maxConnections);
+    asyncTask_t** tasks = malloc(sizeof(asyncTask_t*) * this->maxConnections);
+    size_t starts_count = 0;
+    int idle_ms = 0;
 
     socklen_t addrlen = sizeof(struct sockaddr_in);
 
     while(atomic_load(&this->active) == true) {
-        int ret = poll(this->pfds, this->nfds, this->timeout);
+        http_reap_connections(this);
+        // Deferred requests are retried often, connection timeouts still count in this->timeout steps
+        starts_count = http_start_requests(this, starts, tasks, starts_count);
+        int poll_timeout = ((starts_count > 0) ? DEFER_RETRY_MS : this->timeout);
+        int ret = poll(this->pfds, this->nfds, poll_timeout);
 
         if(ret == -1) continue;
         else if (ret == 0) {
-            for(nfds_t i = 1; i < this->nfds; i++) {
+            idle_ms += poll_timeout;
+            if(idle_ms < this->timeout) continue;
+            idle_ms = 0;
+            for(nfds_t i = FIRST_CONNECTION; i < this->nfds; i++) {
                 if(this->connections[(int)i].timeout == -1) continue;
+                if(this->pfds[i].fd == CLOSING_FD) continue;
                 if((--this->connections[(int)i].timeout) == 0) {
                     printf("Connection %d timeout\n", this->pfds[i].fd);
-                    http_close_connection(&this->connections[(int)i]);
-                    this->pfds[i].fd = -1;
-                    if(i == this->nfds - 1) this->nfds -= 1;
+                    http_drop_connection(this, i);
                 }
             }
             continue;
         }
 
-        for(nfds_t i = 1; i < this->nfds; i++) {
+        if(this->pfds[WAKE_SLOT].revents & POLLIN) http_unpark_connections(this);
+
+        for(nfds_t i = FIRST_CONNECTION; i < this->nfds; i++) {
             if(this->pfds[i].revents == 0)
                 continue;
             if (this->pfds[i].revents & POLLIN) {
                 connection_t* con = &this->connections[i];
-            read_more:
-                if((request->data->bytes_received = SSL_read(con->ssl, request->data->payload, request->data->size)) > 0) {
-                    lock(&con->lock);
-                    if(con->running) {
-                        push(con->requests, request->data);
-                        unlock(&con->lock);
-                    } else {
-                        unlock(&con->lock);
-                        request->server = this;
-                        con->running = true;
-                        request->con = con;
-                        asyncTask_t* task = async((async_func_t)http_process_request, request);
-                        async_detach(&task);
-                        request = malloc(sizeof(request_t));
+                unsigned state = atomic_load(&con->state);
+                if(!http_con_readable(state)) {
+                    // The task owns the buffer, stop polling until it hands it back
+                    state = atomic_fetch_or(&con->state, CON_PARKED);
+                    if(!http_con_readable(state)) this->pfds[i].events = 0;
+                    // Handed back in between, the flag is cleared since we own the state again
+                    else atomic_fetch_and(&con->state, ~CON_PARKED);
+                    continue;
+                }
+                if(state & CON_EXPIRED) {
+                    http_expire_connection(this, i);
+                    continue;
+                }
+                if(http_read_connection(con)) {
+                    // Only the listener changes the state of an idle or reading connection, apart from a task
+                    // flagging it as expired while we read
+                    if(!atomic_compare_exchange_strong(&con->state, &state, CON_PROCESSING)) {
+                        http_expire_connection(this, i);
+                        continue;
                     }
-                    request->data = malloc(sizeof(rcv_data_t));
-                    request->data->payload = malloc(DEFAULT_BUFFER_SIZE);
-                    request->data->size = DEFAULT_BUFFER_SIZE;
-                    if(SSL_pending(con->ssl) > 0) goto read_more;
+                    if((state & CON_STATE_MASK) == CON_READING) eventfd_write(con->notify_fd, 1);
+                    else starts[starts_count++] = con;
                 }
                 else {
-                    if(!con->running) {
-                        printf("Closing bad connection %d\n", this->pfds[i].fd);
-                        http_close_connection(&this->connections[(int)i]);
-                        this->pfds[i].fd = -1;
-                        if(i == this->nfds - 1) this->nfds -= 1;
-                    }
+                    printf("Closing bad connection %d\n", this->pfds[i].fd);
+                    http_drop_connection(this, i);
                     continue;
                 }
                 this->connections[(int)i].timeout = (10 * 1000) / this->timeout;
             }
             else { // POLLERR | POLLHUP
                 printf("Closing connection %d\n", this->pfds[i].fd);
-                http_close_connection(&this->connections[(int)i]);
-                this->pfds[i].fd = -1;
-                if(i == this->nfds - 1) this->nfds -= 1;
+                http_drop_connection(this, i);
             }
         }
 
-        if(this->pfds[0].revents & POLLIN) {
+        starts_count = http_start_requests(this, starts, tasks, starts_count);
+
+        if(this->pfds[LISTEN_SLOT].revents & POLLIN) {
             int32_t connfd = accept(this->fd, (struct sockaddr*)&this->serverAddr, &addrlen);
             if(connfd == 0) continue;
-            for(nfds_t i = 1; i < this->maxConnections; ++i) {
+            for(nfds_t i = FIRST_CONNECTION; i < this->maxConnections; ++i) {
                 if(this->pfds[i].fd == -1) {
                     if(http_open_connection(&this->connections[(int)i], connfd, this->timeout, this->ctx, this->fullchain, this->privatekey)) {
                         printf("New connection %d\n", connfd);
                         this->pfds[i].fd = connfd;
+                        this->pfds[i].events = POLLIN;
                         if(i >= this->nfds) this->nfds += 1;
                     }
                     else {
@@ -523,6 +720,12 @@ static void http_server_worker(asyncTask_t* self, http_server_t* this) {
             }
         }
     }
+    // Deferred requests never started, their connections must not look busy to http_server_stop
+    for(size_t i = 0; i < starts_count; ++i) {
+        (void)http_release_request(starts[i]);
+    }
+    free(starts);
+    free(tasks);
 }
 
 /************************** PUBLIC METHODS **************************/
@@ -534,11 +737,16 @@ http_server_t* http_server_init(const char* ip, int port, int tasks, const char*
     this->protocol = 0;
     this->bakclog = 0;
     this->timeout = 100;
+    this->overload = HTTP_OVERLOAD_DEFER;
+    this->retry_after = HTTP_DEFAULT_RETRY_AFTER;
+    this->request_timeout = HTTP_DEFAULT_REQUEST_TIMEOUT;
     this->active = ATOMIC_VAR_INIT(false);
     this->fd = -1;
+    this->wake_fd = -1;
     this->port = port;
     this->ip = ip;
     this->root = http_init_url_paths();
+    lock_init(&this->routes_lock);
 
     this->fullchain = fullchain;
     this->privatekey = privatekey;
@@ -558,6 +766,9 @@ void http_server_clean(http_server_t** this) {
     async_engine_stop();
 
     http_url_path_clean((*this)->root);
+    lock_destroy(&(*this)->routes_lock);
+    // Children arrays replaced while registering routes
+    epoch_flush();
 
     SSL_CTX_free((*this)->ctx);
     free((*this)->pfds);
@@ -604,30 +815,48 @@ int http_server_start(http_server_t* this, size_t max_connections) {
         return -1;
     }
 
-    this->maxConnections = (max_connections == 0) ? 1 : max_connections;
-    this->nfds = 1;
+    // One more slot for the wake up
+    this->maxConnections = ((max_connections == 0) ? 1 : max_connections) + 1;
+    this->nfds = FIRST_CONNECTION;
     this->pfds = calloc(this->maxConnections, sizeof(*this->pfds));
-    this->pfds[0].fd = this->fd;
-    this->pfds[0].events = POLLIN;
+    this->pfds[LISTEN_SLOT].fd = this->fd;
+    this->pfds[LISTEN_SLOT].events = POLLIN;
+    this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    this->pfds[WAKE_SLOT].fd = this->wake_fd;
+    this->pfds[WAKE_SLOT].events = POLLIN;
 
     this->connections = calloc(this->maxConnections, sizeof(*this->connections));
-    this->connections[0].fd = this->fd;
-    this->connections[0].timeout = -1;
+    this->connections[LISTEN_SLOT].fd = this->fd;
+    this->connections[LISTEN_SLOT].timeout = -1;
+    this->connections[WAKE_SLOT].fd = -1;
+    this->connections[WAKE_SLOT].timeout = -1;
 
     int i;
-    for(i = 1; i < this->maxConnections; ++i) {
+    for(i = FIRST_CONNECTION; i < this->maxConnections; ++i) {
         this->pfds[i].fd = -1;
         this->pfds[i].events = POLLIN;
         this->connections[i].fd = -1;
         this->connections[i].timeout = -1;
+        this->connections[i].server = this;
+        this->connections[i].notify_fd = -1;
+        this->connections[i].cancel = NULL;
     }
 
     atomic_store(&this->active, true);
-    this->listener = async((async_func_t)http_server_worker, this);
+    this->listener = async_priority(AsyncPriorityCritical, (async_func_t)http_server_worker, this);
 
     return 0;
 }
 
+void http_server_set_overload(http_server_t* this, int policy, int retry_after) {
+    this->overload = policy;
+    this->retry_after = ((retry_after > 0) ? retry_after : HTTP_DEFAULT_RETRY_AFTER);
+}
+
+void http_server_set_request_timeout(http_server_t* this, int timeout_ms) {
+    this->request_timeout = ((timeout_ms > 0) ? timeout_ms : 0);
+}
+
 void http_server_stop(http_server_t* this) {
     // Signal threads to stop
     atomic_store(&this->active, false);
@@ -635,21 +864,26 @@ void http_server_stop(http_server_t* this) {
     // Wait for listener thread termination
     await(&this->listener);
 
-    // Close all open connections
-    for(nfds_t i = 1; i < this->nfds; i++) {
-        if(this->connections[i].ssl != NULL) {
-            http_close_connection(&this->connections[i]);
+    // Close all open connections, the ones still used by a request task are closed once the task gives up
+    for(nfds_t i = FIRST_CONNECTION; i < this->nfds; i++) {
+        connection_t* con = &this->connections[i];
+        if(con->ssl == NULL) continue;
+        atomic_fetch_or(&con->state, CON_CLOSED);
+        async_cancel(con->cancel);
+        while((atomic_load(&con->state) & CON_STATE_MASK) != CON_IDLE) {
+            usleep(1000);
         }
+        http_close_connection(con);
     }
 
     close(this->fd);
+    close(this->wake_fd);
+    this->wake_fd = -1;
 
     this->fd = -1;
 }
 
-int http_register_method(http_server_t* this, const char* path, int type, void (*method)(http_request_t*, http_response_t*)) {
-    if(this == NULL || this->root == NULL) return -1;
-
+static int http_register_route(http_server_t* this, const char* path, int type, void (*method)(http_request_t*, http_response_t*)) {
     char* remaining = NULL;
     pathname_t* uri = http_resolve_path(this->root, path, strlen(path), &remaining);
 
@@ -698,6 +932,15 @@ int http_register_method(http_server_t* this, const char* path, int type, void (
     return 0;
 }
 
+int http_register_method(http_server_t* this, const char* path, int type, void (*method)(http_request_t*, http_response_t*)) {
+    if(this == NULL || this->root == NULL) return -1;
+
+    lock(&this->routes_lock);
+    int ret = http_register_route(this, path, type, method);
+    unlock(&this->routes_lock);
+    return ret;
+}
+
 void http_set_response_code(http_response_t* response, int code) {
     response->code = HttpResponses[code].code;
     response->status_line = HttpResponses[code].reason;
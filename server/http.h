@@ -28,6 +28,22 @@
 #define HTTP_404_NOT_FOUND          13
 #define HTTP_405_NOT_ALLOWED        14
 #define HTTP_408_REQUEST_TIMEOUT    15
+#define HTTP_503_SERVICE_UNAVAILABLE 16
+
+// What to do with new requests when every task is busy
+#define HTTP_OVERLOAD_DEFER         0   // Stop reading from the connection until a task is available
+#define HTTP_OVERLOAD_REJECT        1   // Answer 503 with Retry-After and close the connection
+#define HTTP_DEFAULT_RETRY_AFTER    1
+// Time a request has to arrive completely once its first bytes were received, answered with 408 otherwise
+#define HTTP_DEFAULT_REQUEST_TIMEOUT 10000
+
+// Kept by each connection for the handlers, so keep-alive requests can reuse what an earlier request on the
+// same connection resolved. It is zeroed for every new connection
+typedef struct http_con_cache_t {
+    char key[64];
+    size_t value;
+    size_t generation;
+}http_con_cache_t;
 
 typedef struct http_request_t
 {
@@ -39,6 +55,7 @@ typedef struct http_request_t
     const char* version;
     const char* body;
     const char* raw;
+    http_con_cache_t* cache;
 }http_request_t;
 
 typedef struct http_response_t {
@@ -63,6 +80,11 @@ void http_server_clean(http_server_t** this);
 
 int http_server_start(http_server_t* this, size_t max_connections);
 
+void http_server_set_overload(http_server_t* this, int policy, int retry_after);
+
+// Zero or less disables the request deadline
+void http_server_set_request_timeout(http_server_t* this, int timeout_ms);
+
 void http_server_stop(http_server_t* this);
 
 int http_register_method(http_server_t* this, const char* path, int type, void (*method)(http_request_t*, http_response_t*));
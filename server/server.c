@@ -1,4 +1,6 @@
 #include "http.h"
+#include <async.h>
+#include <lock.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +22,11 @@ int main(int argc, char *argv[]) {
             {"tasks", required_argument, NULL, 't'},
             {"key", required_argument, NULL, 'k'},
             {"pem", required_argument, NULL, 3},
+            {"cpus", required_argument, NULL, 4},
+            {"overload", required_argument, NULL, 5},
+            {"retry-after", required_argument, NULL, 6},
+            {"elastic", required_argument, NULL, 7},
+            {"request-timeout", required_argument, NULL, 8},
             {"verbose", no_argument, NULL, 1},
             {"help", no_argument, NULL, 2},
             {NULL, no_argument, NULL, 0}
@@ -30,6 +37,11 @@ int main(int argc, char *argv[]) {
     char* ip = NULL;
     char* fullchain = NULL;
     char* privatekey = NULL;
+    char* cpus = NULL;
+    int overload = HTTP_OVERLOAD_DEFER;
+    int retry_after = HTTP_DEFAULT_RETRY_AFTER;
+    char* elastic = NULL;
+    int request_timeout = HTTP_DEFAULT_REQUEST_TIMEOUT;
     bool parse = true;
     bool verbose = false;
     int port = -1;
@@ -55,6 +67,26 @@ int main(int argc, char *argv[]) {
         case 3:
             fullchain = optarg;
             break;
+        case 4:
+            cpus = optarg;
+            break;
+        case 5:
+            if(strcmp(optarg, "reject") == 0) overload = HTTP_OVERLOAD_REJECT;
+            else if(strcmp(optarg, "defer") == 0) overload = HTTP_OVERLOAD_DEFER;
+            else {
+                printf("Error: Invalid overload policy '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 6:
+            retry_after = atoi(optarg);
+            break;
+        case 7:
+            elastic = optarg;
+            break;
+        case 8:
+            request_timeout = atoi(optarg);
+            break;
         case 1:
             verbose = true;
             break;
@@ -90,17 +122,54 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    if(cpus != NULL && async_engine_affinity(cpus) != EAsync_Success) {
+        printf("Error: Invalid cpu list '%s'\n", cpus);
+        return -1;
+    }
+
+    if(elastic != NULL) {
+        // MIN:MAX[:LATENCY_MS[:IDLE_MS]]
+        unsigned min_threads = 0, max_threads = 0;
+        int latency_ms = 0, idle_ms = 0;
+        if(sscanf(elastic, "%u:%u:%d:%d", &min_threads, &max_threads, &latency_ms, &idle_ms) < 2 ||
+           async_engine_elastic(min_threads, max_threads, latency_ms, idle_ms) != EAsync_Success) {
+            printf("Error: Invalid elastic range '%s'\n", elastic);
+            return -1;
+        }
+    }
+
+    // Block the signals we wait for before any thread is created so they all inherit the mask
+    sigset_t set;
+    int sig;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    // Deferred requests can be answered after the client gave up, a write to it must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     http_server_t* server = http_server_init(ip, port, tasks, fullchain, privatekey);
+    http_server_set_overload(server, overload, retry_after);
+    http_server_set_request_timeout(server, request_timeout);
     app_start(app_argc, app_argv, server);
 
     if(http_server_start(server, connections) == 0) {
-        // Wait for termination request
-        sigset_t set;
-        int sig;
-        sigemptyset(&set);
-        sigaddset(&set, SIGINT);
-        sigprocmask(SIG_BLOCK, &set, NULL);
-        sigwait(&set, &sig);
+        // Wait for termination request, SIGUSR1 prints the engine counters and SIGUSR2 the lock contention report
+        while(sigwait(&set, &sig) == 0 && (sig == SIGUSR1 || sig == SIGUSR2)) {
+            if(sig == SIGUSR2) {
+                fflush(stdout);
+                lock_profile_report(STDOUT_FILENO);
+                continue;
+            }
+            asyncStats_t stats;
+            async_engine_stats(&stats);
+            printf("threads %zu (%zu-%zu) idle %zu pending %zu spawned %zu retired %zu max wait %llu us\n",
+                stats.threads, stats.min_threads, stats.max_threads, stats.idle, stats.pending,
+                stats.spawned, stats.retired, (unsigned long long)stats.max_wait_us);
+            fflush(stdout);
+        }
         // Signal server to terminate
         http_server_stop(server);
         // Only server_clean will terminate the asycn engine so app can terminate